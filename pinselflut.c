@@ -1,4 +1,4 @@
-#define _DEFAULT_SOURCE 1
+#define _GNU_SOURCE 1 // sendmmsg()
 #define _USE_MATH_DEFINES
 #include <stdio.h>
 #include <stdlib.h>
@@ -6,14 +6,27 @@
 #include <string.h>
 #include <strings.h>
 #include <sys/time.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/ioctl.h>
 #include <netdb.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <signal.h>
 #include <math.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <linux/sockios.h>
+#include <sys/sendfile.h>
+#include <sys/inotify.h>
+#endif
+#include <poll.h>
+#include <pthread.h>
 #include "glad/glad.h"
 #include <GLFW/glfw3.h>
 
@@ -41,228 +54,4482 @@ static inline int itoa(int n, char *s) // positive integers only!
 	return i;
 }
 
+// PCG32 (pcg-random.org). Each thread owns its generator, so nothing serializes on the
+// libc rand() lock, and a fixed seed makes strokes reproducible for benchmarks and replay.
+typedef struct
+{
+	uint64_t state, inc;
+} rng_t;
+static __thread rng_t rng;
+static uint64_t rngSeedValue;
+static inline uint32_t rngNext(rng_t *r)
+{
+	uint64_t old = r->state;
+	r->state = old * 6364136223846793005ULL + r->inc;
+	uint32_t xorshifted = (uint32_t)(((old >> 18) ^ old) >> 27);
+	uint32_t rot = (uint32_t)(old >> 59);
+	return (xorshifted >> rot) | (xorshifted << ((-rot) & 31));
+}
+static void rngSeed(rng_t *r, uint64_t seed, uint64_t stream)
+{
+	r->state = 0;
+	r->inc = (stream << 1) | 1;
+	rngNext(r);
+	r->state += seed;
+	rngNext(r);
+}
+
 static char *hostname;
 static int port;
 static int sockfd = 0;
+static unsigned connections = 0; // counts (re)connects, so sources know when the server lost what they sent
+static pthread_mutex_t connectMutex = PTHREAD_MUTEX_INITIALIZER; // held while sockfd is replaced
+
+// Color forms the server accepted besides rrggbbaa, found by detectColorForms() at connect time.
+// Opaque colors are sent as rrggbb, or as gg when they are gray.
+enum { FORM_RGB = 1, FORM_GRAY = 2 };
+static int colorForms = 0;
+
+// Low latency mode (-l KiB) lets the kernel hold only that much unsent data (TCP_NOTSENT_LOWAT)
+// in a small send buffer. The sender waits for the socket to drain below the mark before it takes
+// the next chunk from the lanes, so the backlog stays where strokes can still overtake it. Bursts
+// are corked into full segments and uncorked with TCP_NODELAY once the lanes run dry.
+static int lowLatencyKiB = 0; // 0: kernel defaults
+static int corked = 0;
+static void socketTune(int fd)
+{
+	if (!lowLatencyKiB)
+		return;
+	int lowat = lowLatencyKiB * 1024, sndbuf = lowat * 4;
+	#ifdef TCP_NOTSENT_LOWAT
+	setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, sizeof(lowat));
+	#endif
+	setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &(int){ 1 }, sizeof(int));
+}
+static void socketCork(int fd, int cork)
+{
+	#ifdef TCP_CORK
+	if (lowLatencyKiB && cork != corked)
+	{
+		setsockopt(fd, IPPROTO_TCP, TCP_CORK, &cork, sizeof(cork));
+		corked = cork;
+	}
+	#endif
+}
+// bytes in the kernel's send queue, and how many of them have not been sent at all
+static void socketQueue(int fd, int *queued, int *unsent)
+{
+	*queued = *unsent = 0;
+	#ifdef SIOCOUTQ
+	ioctl(fd, SIOCOUTQ, queued);
+	#endif
+	#ifdef SIOCOUTQNSD
+	ioctl(fd, SIOCOUTQNSD, unsent);
+	#endif
+}
+
 static void flutConnect()
 {
+	pthread_mutex_lock(&connectMutex);
 	if (sockfd)
 		close(sockfd);
 
-	struct hostent *server;
-	server = gethostbyname(hostname);
-	if (server == NULL)
+	struct hostent *server;
+	server = gethostbyname(hostname);
+	if (server == NULL)
+	{
+		perror("ERROR no such host\n");
+		exit(1);
+	}
+	struct sockaddr_in serv_addr;
+	bzero((char *) &serv_addr, sizeof(serv_addr));
+	serv_addr.sin_family = AF_INET;
+	bcopy(server->h_addr_list[0], (char *)&serv_addr.sin_addr.s_addr, server->h_length);
+	serv_addr.sin_port = htons(port);
+
+	sockfd = socket(AF_INET, SOCK_STREAM, 0);
+	if (sockfd < 0)
+	{
+		perror("ERROR opening socket\n");
+		exit(2);
+	}
+
+	if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &(int){ 1 }, sizeof(int)) < 0)
+	{
+		perror("setsockopt(SO_REUSEPORT) failed\n");
+		exit(3);
+	}
+	socketTune(sockfd);
+	corked = 0;
+	
+	if (connect(sockfd,(struct sockaddr*)&serv_addr, sizeof(serv_addr)) < 0)
+	{
+		perror("ERROR connecting\n");
+		exit(4);
+	}
+
+	fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL, 0) | O_NONBLOCK);
+	signal(SIGPIPE, SIG_IGN);
+	__atomic_add_fetch(&connections, 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&connectMutex);
+}
+
+static int pixelsWidth = 640, pixelsHeight = 480;
+static uint8_t *pixels;
+
+// decimal text of every coordinate on the canvas, padded to 8 bytes with the length in the last
+static char (*coordText)[8];
+static void coordInit()
+{
+	int count = pixelsWidth > pixelsHeight ? pixelsWidth : pixelsHeight;
+	coordText = realloc(coordText, count * sizeof(*coordText));
+	for (int i = 0; i < count; i++)
+		coordText[i][7] = (char)itoa(i, coordText[i]);
+}
+static void readSize()
+{
+	// retrieve server screen resolution using the SIZE command
+	fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL, 0) & (~O_NONBLOCK)); // temporarily disable non-blocking mode
+	int n = write(sockfd, "SIZE\n", 5);
+	if (n == 5)
+	{
+		char result[256];
+		n = read(sockfd, result, 256);
+		if (n > 5 && !strncmp(result, "SIZE ", 5))
+		{
+			int w, h;
+			n = sscanf(result, "SIZE %d %d", &w, &h);
+			if (n == 2)
+			{
+				pixelsWidth = w;
+				pixelsHeight = h;
+				printf("Received screen size from server: %dx%d\n", pixelsWidth, pixelsHeight);
+			}
+			else
+				printf("Bad SIZE payload!\n");
+		}
+		else
+			printf("Bad SIZE response!\n");
+	}
+	else
+		printf("Could not send SIZE command!\n");
+	fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL, 0) | O_NONBLOCK); // reenable non-blocking mode
+	coordInit();
+}
+
+// Local canvas blending in 8 bit fixed point: d * (255 - a) + s * a, divided by 255 with rounding.
+// The span kernels work on per-byte source and alpha arrays so the RGB layout of pixels needs no
+// shuffles; blendInit() picks the widest implementation the CPU supports.
+static inline uint8_t blend8(uint8_t d, uint8_t s, uint8_t a)
+{
+	unsigned t = d * (255u - a) + s * a + 128u;
+	return (uint8_t)((t + (t >> 8)) >> 8);
+}
+
+static void blendBytesScalar(uint8_t *dst, const uint8_t *src, const uint8_t *alpha, int n)
+{
+	for (int i = 0; i < n; i++)
+		dst[i] = blend8(dst[i], src[i], alpha[i]);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+__attribute__((target("sse2")))
+static void blendBytesSSE2(uint8_t *dst, const uint8_t *src, const uint8_t *alpha, int n)
+{
+	const __m128i zero = _mm_setzero_si128(), c255 = _mm_set1_epi16(255), c128 = _mm_set1_epi16(128);
+	int i = 0;
+	for (; i + 16 <= n; i += 16)
+	{
+		__m128i d = _mm_loadu_si128((const __m128i*)(dst + i));
+		__m128i s = _mm_loadu_si128((const __m128i*)(src + i));
+		__m128i a = _mm_loadu_si128((const __m128i*)(alpha + i));
+		__m128i dl = _mm_unpacklo_epi8(d, zero), dh = _mm_unpackhi_epi8(d, zero);
+		__m128i sl = _mm_unpacklo_epi8(s, zero), sh = _mm_unpackhi_epi8(s, zero);
+		__m128i al = _mm_unpacklo_epi8(a, zero), ah = _mm_unpackhi_epi8(a, zero);
+		__m128i tl = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(dl, _mm_sub_epi16(c255, al)), _mm_mullo_epi16(sl, al)), c128);
+		__m128i th = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(dh, _mm_sub_epi16(c255, ah)), _mm_mullo_epi16(sh, ah)), c128);
+		tl = _mm_srli_epi16(_mm_add_epi16(tl, _mm_srli_epi16(tl, 8)), 8);
+		th = _mm_srli_epi16(_mm_add_epi16(th, _mm_srli_epi16(th, 8)), 8);
+		_mm_storeu_si128((__m128i*)(dst + i), _mm_packus_epi16(tl, th));
+	}
+	blendBytesScalar(dst + i, src + i, alpha + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void blendBytesAVX2(uint8_t *dst, const uint8_t *src, const uint8_t *alpha, int n)
+{
+	const __m256i c255 = _mm256_set1_epi16(255), c128 = _mm256_set1_epi16(128);
+	int i = 0;
+	for (; i + 32 <= n; i += 32)
+	{
+		__m256i t[2];
+		for (int h = 0; h < 2; h++)
+		{
+			__m256i d = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(dst + i + h * 16)));
+			__m256i s = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(src + i + h * 16)));
+			__m256i a = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(alpha + i + h * 16)));
+			t[h] = _mm256_add_epi16(_mm256_add_epi16(_mm256_mullo_epi16(d, _mm256_sub_epi16(c255, a)), _mm256_mullo_epi16(s, a)), c128);
+			t[h] = _mm256_srli_epi16(_mm256_add_epi16(t[h], _mm256_srli_epi16(t[h], 8)), 8);
+		}
+		// packus interleaves the 128 bit lanes, put the quadwords back in order
+		__m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(t[0], t[1]), 0xd8);
+		_mm256_storeu_si256((__m256i*)(dst + i), packed);
+	}
+	blendBytesScalar(dst + i, src + i, alpha + i, n - i);
+}
+#endif
+
+static void (*blendBytes)(uint8_t *dst, const uint8_t *src, const uint8_t *alpha, int n) = blendBytesScalar;
+
+// index of the first byte in which a and b differ, n if they are equal
+static int firstDifferenceScalar(const uint8_t *a, const uint8_t *b, int n)
+{
+	int i = 0;
+	while (i < n && a[i] == b[i])
+		i++;
+	return i;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+static int firstDifferenceSSE2(const uint8_t *a, const uint8_t *b, int n)
+{
+	int i = 0;
+	for (; i + 16 <= n; i += 16)
+	{
+		__m128i eq = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(a + i)), _mm_loadu_si128((const __m128i*)(b + i)));
+		unsigned mask = ~(unsigned)_mm_movemask_epi8(eq) & 0xffff;
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+	return i + firstDifferenceScalar(a + i, b + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static int firstDifferenceAVX2(const uint8_t *a, const uint8_t *b, int n)
+{
+	int i = 0;
+	for (; i + 32 <= n; i += 32)
+	{
+		__m256i eq = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(a + i)), _mm256_loadu_si256((const __m256i*)(b + i)));
+		unsigned mask = ~(unsigned)_mm256_movemask_epi8(eq);
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+	return i + firstDifferenceScalar(a + i, b + i, n - i);
+}
+#endif
+
+static int (*firstDifference)(const uint8_t *a, const uint8_t *b, int n) = firstDifferenceScalar;
+
+// the SIMD kernels must match the scalar reference bit for bit
+static int blendCheck(void (*kernel)(uint8_t *dst, const uint8_t *src, const uint8_t *alpha, int n))
+{
+	enum { N = 1021 };
+	uint8_t dst[N], ref[N], src[N], alpha[N];
+	rng_t testRng;
+	rngSeed(&testRng, 1, 1);
+	for (int i = 0; i < N; i++)
+	{
+		uint32_t r = rngNext(&testRng);
+		dst[i] = ref[i] = r; src[i] = r >> 8; alpha[i] = i < 256 ? i : r >> 16;
+	}
+	kernel(dst, src, alpha, N);
+	blendBytesScalar(ref, src, alpha, N);
+	return !memcmp(dst, ref, N);
+}
+
+static int firstDifferenceCheck(int (*kernel)(const uint8_t *a, const uint8_t *b, int n))
+{
+	enum { N = 1021 };
+	uint8_t a[N], b[N];
+	for (int i = 0; i < N; i++)
+		a[i] = b[i] = i * 7;
+	for (int d = 0; d <= N; d++)
+	{
+		if (d < N)
+			b[d] ^= 1 << (d & 7);
+		for (int n = d > 40 ? d - 40 : 0; n <= N; n += 1 + (n > d + 40) * 97)
+			if (kernel(a, b, n) != firstDifferenceScalar(a, b, n))
+				return 0;
+		if (d < N)
+			b[d] = a[d];
+	}
+	return 1;
+}
+
+// blend n pixels of a single color with per pixel alphas into the RGB row dst
+#define BLEND_CHUNK 64
+static void blendSpanAlphas(uint8_t *dst, struct nk_color color, const uint8_t *alphas, int n)
+{
+	uint8_t src[BLEND_CHUNK * 3], alpha[BLEND_CHUNK * 3];
+	for (int i = 0; i < BLEND_CHUNK; i++)
+	{
+		src[i * 3 + 0] = color.r; src[i * 3 + 1] = color.g; src[i * 3 + 2] = color.b;
+	}
+	for (int i = 0; i < n; i += BLEND_CHUNK)
+	{
+		int count = n - i < BLEND_CHUNK ? n - i : BLEND_CHUNK;
+		for (int j = 0; j < count; j++)
+			alpha[j * 3 + 0] = alpha[j * 3 + 1] = alpha[j * 3 + 2] = alphas[i + j];
+		blendBytes(dst + i * 3, src, alpha, count * 3);
+	}
+}
+
+// blend n pixels of a single color into the RGB row dst
+static void blendSpanColor(uint8_t *dst, struct nk_color color, int n)
+{
+	uint8_t src[BLEND_CHUNK * 3], alpha[BLEND_CHUNK * 3];
+	for (int i = 0; i < BLEND_CHUNK; i++)
+	{
+		src[i * 3 + 0] = color.r; src[i * 3 + 1] = color.g; src[i * 3 + 2] = color.b;
+	}
+	memset(alpha, color.a, sizeof(alpha));
+	for (int i = 0; i < n; i += BLEND_CHUNK)
+		blendBytes(dst + i * 3, src, alpha, (n - i < BLEND_CHUNK ? n - i : BLEND_CHUNK) * 3);
+}
+
+static void blendInit()
+{
+	#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+	{
+		blendBytes = blendBytesAVX2;
+		firstDifference = firstDifferenceAVX2;
+	}
+	else if (__builtin_cpu_supports("sse2"))
+	{
+		blendBytes = blendBytesSSE2;
+		firstDifference = firstDifferenceSSE2;
+	}
+	#endif
+
+	if (!blendCheck(blendBytes))
+	{
+		fprintf(stderr, "SIMD blending does not match the reference, using scalar blending.\n");
+		blendBytes = blendBytesScalar;
+	}
+	if (!firstDifferenceCheck(firstDifference))
+	{
+		fprintf(stderr, "SIMD comparison does not match the reference, using scalar comparison.\n");
+		firstDifference = firstDifferenceScalar;
+	}
+}
+
+// Send lanes: producers queue complete commands into the lane of their priority and the sender
+// thread moves them to the socket, either by strict priority or by deficit round robin. Chunks
+// taken from a lane always end on a command boundary, so lanes can be switched between chunks.
+enum { LANE_INTERACTIVE, LANE_PREDICTION, LANE_NORMAL, LANE_BULK, LANE_COUNT };
+static const char *laneNames[LANE_COUNT] = { "Interactive", "Prediction", "Normal", "Bulk" };
+enum { SEND_STRICT, SEND_ROUND_ROBIN, SEND_POLICY_COUNT };
+static const char *sendPolicyNames[SEND_POLICY_COUNT] = { "Strict Priority", "Round Robin" };
+#define SEND_CHUNK (16 * 1024)
+#define MAX_WRITE (64 * 1024)
+static int writeKiB = SEND_CHUNK / 1024; // largest write
+static int paceKiBps = 0; // 0: as fast as the socket takes it
+typedef struct
+{
+	pthread_mutex_t mutex;
+	pthread_cond_t space;
+	unsigned char *data;
+	size_t start, end, size;
+	size_t limit; // producers wait while more than this is queued, 0 for no limit
+	uint64_t pushed, taken;
+	double since; // monotonicTime() when the oldest queued byte arrived
+	int quantum, deficit; // deficit round robin
+	int record; // size of the binary records it holds for the UDP sender, 0 for commands
+} lane_t;
+static lane_t lanes[LANE_COUNT];
+static int sendPolicy = SEND_STRICT;
+static struct
+{
+	pthread_mutex_t mutex;
+	pthread_cond_t wake;
+	unsigned signals;
+	unsigned flushes; // end of frame requests
+} sender = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0 };
+
+// Flush policy: queued commands wait in the lanes until a frame ends, flushBytes have gathered or
+// the oldest of them is flushDeadlineMs old. Then the sender drains the lanes in large chunks.
+static int flushKiB = SEND_CHUNK / 1024;
+static int flushDeadlineMs = 10;
+
+static double monotonicTime()
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static void lanePush(int lane, const unsigned char *data, size_t len)
+{
+	if (!len)
+		return;
+	lane_t *l = &lanes[lane];
+	pthread_mutex_lock(&l->mutex);
+	while (l->limit && l->end - l->start > l->limit)
+		pthread_cond_wait(&l->space, &l->mutex);
+	if (l->end + len > l->size)
+	{
+		memmove(l->data, l->data + l->start, l->end - l->start);
+		l->end -= l->start;
+		l->start = 0;
+		if (l->end + len > l->size)
+		{
+			l->size = l->size * 2 > l->end + len ? l->size * 2 : l->end + len;
+			l->data = realloc(l->data, l->size);
+		}
+	}
+	if (l->end == l->start)
+		l->since = monotonicTime();
+	memcpy(l->data + l->end, data, len);
+	l->end += len;
+	l->pushed += len;
+	pthread_mutex_unlock(&l->mutex);
+
+	pthread_mutex_lock(&sender.mutex);
+	sender.signals++;
+	pthread_cond_broadcast(&sender.wake);
+	pthread_mutex_unlock(&sender.mutex);
+}
+
+static size_t laneQueued(int lane)
+{
+	lane_t *l = &lanes[lane];
+	pthread_mutex_lock(&l->mutex);
+	size_t queued = l->end - l->start;
+	pthread_mutex_unlock(&l->mutex);
+	return queued;
+}
+
+// bytes queued over all lanes of the sender and the arrival time of the oldest of them
+static size_t lanesPending(double *oldest)
+{
+	size_t pending = 0;
+	*oldest = INFINITY;
+	for (int lane = 0; lane < LANE_COUNT; lane++)
+	{
+		lane_t *l = &lanes[lane];
+		if (l->record)
+			continue;
+		pthread_mutex_lock(&l->mutex);
+		if (l->end > l->start)
+		{
+			pending += l->end - l->start;
+			if (l->since < *oldest)
+				*oldest = l->since;
+		}
+		pthread_mutex_unlock(&l->mutex);
+	}
+	return pending;
+}
+
+// drops everything the sender has not taken yet
+static void laneDiscard(int lane)
+{
+	lane_t *l = &lanes[lane];
+	pthread_mutex_lock(&l->mutex);
+	l->start = l->end;
+	pthread_cond_broadcast(&l->space);
+	pthread_mutex_unlock(&l->mutex);
+}
+
+// takes up to max bytes of whole commands or records
+static size_t laneTake(int lane, unsigned char *dst, size_t max)
+{
+	lane_t *l = &lanes[lane];
+	pthread_mutex_lock(&l->mutex);
+	size_t n = l->end - l->start;
+	if (n > max)
+	{
+		n = max;
+		while (!l->record && n > 0 && l->data[l->start + n - 1] != '\n')
+			n--;
+	}
+	if (l->record)
+		n -= n % l->record;
+	memcpy(dst, l->data + l->start, n);
+	l->start += n;
+	l->taken += n;
+	pthread_cond_broadcast(&l->space);
+	pthread_mutex_unlock(&l->mutex);
+	return n;
+}
+
+static size_t senderPick(unsigned char *chunk, size_t max)
+{
+	if (sendPolicy == SEND_STRICT)
+	{
+		for (int lane = 0; lane < LANE_COUNT; lane++)
+		{
+			size_t n = lanes[lane].record ? 0 : laneTake(lane, chunk, max);
+			if (n)
+				return n;
+		}
+		return 0;
+	}
+
+	// deficit round robin: each turn a lane with data earns its quantum and may send that much
+	static int lane = 0, turn = 0;
+	for (int visited = 0; visited < 2 * LANE_COUNT; visited++)
+	{
+		lane_t *l = &lanes[lane];
+		if (!turn)
+		{
+			if (l->record || !laneQueued(lane))
+			{
+				l->deficit = 0;
+				lane = (lane + 1) % LANE_COUNT;
+				continue;
+			}
+			l->deficit += l->quantum;
+			turn = 1;
+		}
+		size_t n = l->deficit > 0 ? laneTake(lane, chunk, (size_t)l->deficit < max ? (size_t)l->deficit : max) : 0;
+		if (n)
+		{
+			l->deficit -= (int)n;
+			return n;
+		}
+		if (!laneQueued(lane))
+			l->deficit = 0;
+		turn = 0;
+		lane = (lane + 1) % LANE_COUNT;
+	}
+	return 0;
+}
+
+// ends the frame: everything queued so far is sent without waiting for the deadline
+static void senderFlush()
+{
+	pthread_mutex_lock(&sender.mutex);
+	sender.flushes++;
+	sender.signals++;
+	pthread_cond_signal(&sender.wake);
+	pthread_mutex_unlock(&sender.mutex);
+}
+
+static void senderWait(unsigned signals, double seconds)
+{
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	double until = now.tv_sec + now.tv_usec * 1e-6 + seconds;
+	struct timespec deadline = { (time_t)until, (long)((until - floor(until)) * 1e9) };
+	pthread_mutex_lock(&sender.mutex);
+	while (sender.signals == signals &&
+		pthread_cond_timedwait(&sender.wake, &sender.mutex, &deadline) != ETIMEDOUT);
+	pthread_mutex_unlock(&sender.mutex);
+}
+
+// Held blob (-b): a file of commands encoded ahead of time that the sender streams in a loop
+// whenever the lanes are empty. The commands go from the page cache to the socket by sendfile()
+// and are never copied through userspace; the mapping is only read to end each write on a command.
+#define BLOB_MAGIC "PFBLOB1\n"
+typedef struct
+{
+	char magic[8];
+	uint32_t width, height; // of the canvas it was encoded for
+	uint32_t x, y, w, h; // the rectangle its commands cover
+	uint32_t encoding; // FORM_* bits of the color forms it uses
+	uint32_t offset; // of the commands in the file, page aligned
+	uint64_t length; // of the commands
+} blob_header_t; // in native byte order
+static struct
+{
+	int fd, hold; // hold: keep streaming it
+	const unsigned char *map; // the whole file
+	size_t begin, end; // the commands
+	uint64_t loops;
+} blob = { -1, 0, NULL, 0, 0, 0 };
+
+// picks the next whole commands of the blob, at most max bytes
+static void blobPick(size_t *start, size_t *end, size_t max)
+{
+	static size_t next = 0;
+	if (next < blob.begin || next >= blob.end)
+	{
+		if (next)
+			__atomic_add_fetch(&blob.loops, 1, __ATOMIC_RELAXED);
+		next = blob.begin;
+	}
+	*start = next;
+	*end = blob.end - next > max ? next + max : blob.end;
+	while (*end > *start + 1 && blob.map[*end - 1] != '\n')
+		(*end)--;
+	next = *end;
+}
+
+static ssize_t blobWrite(int fd, size_t start, size_t end)
+{
+	#ifdef __linux__
+	off_t offset = start;
+	return sendfile(fd, blob.fd, &offset, end - start);
+	#else
+	return write(fd, blob.map + start, end - start);
+	#endif
+}
+
+static void *senderThread(void *arg)
+{
+	unsigned char chunk[MAX_WRITE];
+	size_t chunkStart = 0, chunkEnd = 0;
+	size_t blobStart = 0, blobEnd = 0;
+	double lastWrite = monotonicTime();
+	double paceCredit = 0, paceTime = lastWrite; // bytes that may be written without exceeding the pace
+	unsigned flushes = 0;
+	int draining = 0;
+	for (;;)
+	{
+		if (chunkStart == chunkEnd && blobStart == blobEnd)
+		{
+			int holding = blob.map && __atomic_load_n(&blob.hold, __ATOMIC_RELAXED);
+			pthread_mutex_lock(&sender.mutex);
+			unsigned signals = sender.signals;
+			int flushRequested = sender.flushes != flushes;
+			flushes = sender.flushes;
+			pthread_mutex_unlock(&sender.mutex);
+
+			if (!draining)
+			{
+				double oldest, now = monotonicTime();
+				size_t pending = lanesPending(&oldest);
+				double due = oldest + flushDeadlineMs / 1000.0;
+				if (pending && (flushRequested || pending >= (size_t)flushKiB * 1024 || due <= now))
+					draining = 1;
+				else if (!holding && (pending || now - lastWrite < 1.0))
+				{
+					senderWait(signals, pending ? due - now : lastWrite + 1.0 - now);
+					continue;
+				}
+			}
+
+			// in low latency mode pick the next chunk only once the kernel queue has drained
+			if (lowLatencyKiB && poll(&(struct pollfd){ sockfd, POLLOUT, 0 }, 1, 100) == 0)
+				continue;
+
+			chunkStart = 0;
+			size_t max = writeKiB * 1024 < MAX_WRITE ? writeKiB * 1024 : MAX_WRITE;
+			if (lowLatencyKiB && (size_t)lowLatencyKiB * 1024 < max)
+				max = lowLatencyKiB * 1024;
+			chunkEnd = senderPick(chunk, max);
+			if (!chunkEnd && holding)
+				blobPick(&blobStart, &blobEnd, max);
+			socketCork(sockfd, chunkEnd > 0 || blobEnd > blobStart);
+			if (!chunkEnd && !holding)
+			{
+				draining = 0;
+				if (monotonicTime() - lastWrite < 1.0)
+					continue;
+				chunk[0] = '\n'; // keep alive
+				chunkEnd = 1;
+			}
+		}
+
+		if (paceKiBps)
+		{
+			double now = monotonicTime(), rate = paceKiBps * 1024.0;
+			paceCredit += (now - paceTime) * rate;
+			paceTime = now;
+			if (paceCredit > MAX_WRITE)
+				paceCredit = MAX_WRITE;
+			if (paceCredit < 0)
+			{
+				usleep((useconds_t)(-paceCredit / rate * 1e6));
+				continue;
+			}
+		}
+
+		int fromBlob = blobStart < blobEnd;
+		ssize_t n = fromBlob ? blobWrite(sockfd, blobStart, blobEnd) : write(sockfd, chunk + chunkStart, chunkEnd - chunkStart);
+		if (n > 0)
+		{
+			if (fromBlob)
+				blobStart += n;
+			else
+				chunkStart += n;
+			lastWrite = monotonicTime();
+			paceCredit -= n;
+		}
+		else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			poll(&(struct pollfd){ sockfd, POLLOUT, 0 }, 1, 100);
+		else if (n < 0 && (errno == EPIPE || errno == ECONNRESET))
+		{
+			printf("reconnecting.\n");
+			flutConnect();
+			while (chunkStart > 0 && chunk[chunkStart - 1] != '\n')
+				chunkStart--; // resend the interrupted command
+			while (blobStart > blob.begin && blob.map[blobStart - 1] != '\n')
+				blobStart--;
+		}
+		else if (n < 0 && errno != EINTR)
+		{
+			fprintf(stderr, "ERROR %d writing to socket\n", errno);
+			exit(1);
+		}
+	}
+	return NULL;
+}
+
+static void senderInit()
+{
+	const size_t limits[LANE_COUNT] = { 0, 0, 1024 * 1024, 1024 * 1024 };
+	const int quanta[LANE_COUNT] = { 64 * 1024, 16 * 1024, 8 * 1024, 4 * 1024 };
+	for (int i = 0; i < LANE_COUNT; i++)
+	{
+		pthread_mutex_init(&lanes[i].mutex, NULL);
+		pthread_cond_init(&lanes[i].space, NULL);
+		lanes[i].limit = limits[i];
+		lanes[i].quantum = quanta[i];
+	}
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, senderThread, NULL))
+	{
+		fprintf(stderr, "ERROR creating the sender thread\n");
+		exit(1);
+	}
+	pthread_detach(thread);
+}
+
+// Throughput probe (-p): before drawing, timed bursts rewrite a few pixels in the bottom right
+// corner with each candidate write size. The server answers the SIZE request that follows a burst
+// only after working through it, which gives its accepted rate, and reading the pixels back shows
+// whether it dropped commands. The best setting is cached per host:port for the next launch.
+#define PROBE_SAMPLES 16
+#define PROBE_SECONDS 0.25
+static char probeLine[256];
+static int probeLineLength = 0;
+
+// reads one response line from the blocking socket, 0 after two seconds of silence
+static int probeRead(char *line, int size)
+{
+	for (;;)
+	{
+		char *end = memchr(probeLine, '\n', probeLineLength);
+		if (end)
+		{
+			int n = (int)(end - probeLine) + 1;
+			snprintf(line, size, "%.*s", n - 1, probeLine);
+			memmove(probeLine, probeLine + n, probeLineLength - n);
+			probeLineLength -= n;
+			return 1;
+		}
+		if (probeLineLength == sizeof(probeLine))
+			probeLineLength = 0; // garbage
+		if (poll(&(struct pollfd){ sockfd, POLLIN, 0 }, 1, 2000) <= 0)
+			return 0;
+		int n = read(sockfd, probeLine + probeLineLength, sizeof(probeLine) - probeLineLength);
+		if (n <= 0)
+			return 0;
+		probeLineLength += n;
+	}
+}
+
+static int probeWrite(const char *data, size_t len)
+{
+	while (len)
+	{
+		int n = write(sockfd, data, len);
+		if (n <= 0)
+			return 0;
+		data += n;
+		len -= n;
+	}
+	return 1;
+}
+
+// reads the sample pixels back as 0xrrggbb, 0 if the server does not answer
+static int probeReadback(uint32_t *colors)
+{
+	char request[PROBE_SAMPLES * 24], line[256];
+	int length = 0;
+	for (int i = 0; i < PROBE_SAMPLES; i++)
+		length += sprintf(request + length, "PX %d %d\n", pixelsWidth - 1 - i, pixelsHeight - 1);
+	if (!probeWrite(request, length))
+		return 0;
+	for (int i = 0; i < PROBE_SAMPLES; i++)
+	{
+		int x, y;
+		unsigned color;
+		if (!probeRead(line, sizeof(line)) || sscanf(line, "PX %d %d %x", &x, &y, &color) != 3 ||
+			pixelsWidth - 1 - x < 0 || pixelsWidth - 1 - x >= PROBE_SAMPLES)
+			return 0;
+		colors[pixelsWidth - 1 - x] = color & 0xffffff;
+	}
+	return 1;
+}
+
+// one burst with the given setting, returns the accepted bytes per second or 0 on failure
+static double probeBurst(int writeSize, int pace, int *lossy)
+{
+	static char block[MAX_WRITE];
+	uint32_t expected[PROBE_SAMPLES], actual[PROBE_SAMPLES];
+	size_t length = 0;
+	for (uint32_t i = 0; length + 32 < sizeof(block); i++)
+	{
+		int sample = i % PROBE_SAMPLES;
+		expected[sample] = (i * 0x9e3779b1u) >> 8;
+		length += sprintf(block + length, "PX %d %d %06x\n", pixelsWidth - 1 - sample, pixelsHeight - 1, expected[sample]);
+	}
+
+	double start = monotonicTime(), now = start;
+	size_t sent = 0;
+	while (now - start < PROBE_SECONDS)
+	{
+		for (size_t offset = 0; offset < length; offset += writeSize)
+			if (!probeWrite(block + offset, offset + writeSize < length ? writeSize : length - offset))
+				return 0;
+		sent += length;
+		now = monotonicTime();
+		if (pace && sent > (now - start) * pace * 1024.0)
+			usleep((useconds_t)((sent / (pace * 1024.0) - (now - start)) * 1e6));
+	}
+
+	char line[256];
+	if (!probeWrite("SIZE\n", 5))
+		return 0;
+	do
+		if (!probeRead(line, sizeof(line)))
+			return 0;
+	while (strncmp(line, "SIZE", 4));
+	double rate = sent / (monotonicTime() - start);
+
+	if (!probeReadback(actual))
+		return 0;
+	*lossy = memcmp(expected, actual, sizeof(expected)) != 0;
+	return rate;
+}
+
+static void probeCachePath(char *path, size_t size)
+{
+	const char *cache = getenv("XDG_CACHE_HOME"), *home = getenv("HOME");
+	if (cache)
+		snprintf(path, size, "%s/pinselflut-probe", cache);
+	else
+		snprintf(path, size, "%s/.cache/pinselflut-probe", home ? home : ".");
+}
+
+// applies the cached setting for this server, returns 0 if there is none
+static int probeLoad()
+{
+	char path[1024], key[512], line[1024];
+	probeCachePath(path, sizeof(path));
+	snprintf(key, sizeof(key), "%s:%d ", hostname, port);
+	FILE *file = fopen(path, "r");
+	if (!file)
+		return 0;
+	int found = 0;
+	while (!found && fgets(line, sizeof(line), file))
+		found = !strncmp(line, key, strlen(key)) &&
+			sscanf(line + strlen(key), "%d %d", &writeKiB, &paceKiBps) == 2;
+	fclose(file);
+	if (found)
+		printf("Using cached probe result: %d KiB writes, pace %d KiB/s\n", writeKiB, paceKiBps);
+	return found;
+}
+
+static void probeSave(double rate)
+{
+	char path[1024], key[512], line[1024];
+	probeCachePath(path, sizeof(path));
+	snprintf(key, sizeof(key), "%s:%d ", hostname, port);
+	char *kept = NULL;
+	size_t keptLength = 0;
+	FILE *file = fopen(path, "r");
+	if (file)
+	{
+		while (fgets(line, sizeof(line), file))
+		{
+			if (!strncmp(line, key, strlen(key)))
+				continue;
+			kept = realloc(kept, keptLength + strlen(line) + 1);
+			strcpy(kept + keptLength, line);
+			keptLength += strlen(line);
+		}
+		fclose(file);
+	}
+	file = fopen(path, "w");
+	if (!file)
+	{
+		fprintf(stderr, "Could not write the probe cache %s\n", path);
+		free(kept);
+		return;
+	}
+	if (kept)
+		fputs(kept, file);
+	fprintf(file, "%s%d %d %.0f\n", key, writeKiB, paceKiBps, rate / 1024.0);
+	fclose(file);
+	free(kept);
+}
+
+static void probe()
+{
+	fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL, 0) & (~O_NONBLOCK));
+	uint32_t original[PROBE_SAMPLES];
+	if (pixelsWidth < PROBE_SAMPLES || !probeReadback(original))
+	{
+		printf("Server does not support reading pixels, not probing.\n");
+		fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL, 0) | O_NONBLOCK);
+		return;
+	}
+
+	const int sizes[] = { 1, 4, 16, 64 };
+	double best = 0, bestLossy = 0;
+	int bestSize = writeKiB, bestLossySize = 0;
+	for (int i = 0; i < (int)(sizeof(sizes) / sizeof(sizes[0])); i++)
+	{
+		int lossy = 0;
+		double rate = probeBurst(sizes[i] * 1024, 0, &lossy);
+		printf("Probe: %2d KiB writes: %8.0f KiB/s%s\n", sizes[i], rate / 1024.0, lossy ? ", dropped pixels" : "");
+		if (!lossy && rate > best)
+			best = rate, bestSize = sizes[i];
+		if (lossy && rate > bestLossy)
+			bestLossy = rate, bestLossySize = sizes[i];
+	}
+	writeKiB = bestSize;
+	paceKiBps = 0;
+	if (bestLossy > best)
+	{
+		// flooding loses pixels, see whether a slower pace gets more of them through
+		for (int percent = 75; percent >= 25; percent -= 25)
+		{
+			int lossy = 0, pace = (int)(bestLossy / 1024.0 * percent / 100);
+			double rate = probeBurst(bestLossySize * 1024, pace, &lossy);
+			printf("Probe: %2d KiB writes paced at %d KiB/s: %8.0f KiB/s%s\n", bestLossySize, pace, rate / 1024.0, lossy ? ", dropped pixels" : "");
+			if (!lossy && rate > best)
+			{
+				best = rate;
+				writeKiB = bestLossySize;
+				paceKiBps = pace;
+				break;
+			}
+		}
+	}
+
+	char restore[PROBE_SAMPLES * 32];
+	int length = 0;
+	for (int i = 0; i < PROBE_SAMPLES; i++)
+		length += sprintf(restore + length, "PX %d %d %06x\n", pixelsWidth - 1 - i, pixelsHeight - 1, original[i]);
+	probeWrite(restore, length);
+	fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL, 0) | O_NONBLOCK);
+
+	if (best > 0)
+	{
+		printf("Probe: using %d KiB writes, pace %d KiB/s\n", writeKiB, paceKiBps);
+		probeSave(best);
+	}
+	else
+		printf("Probe: no setting got through without dropped pixels, keeping the defaults.\n");
+}
+
+// reads back the corner pixel as 0xrrggbb, -1 if the server does not answer with it
+static int detectRead()
+{
+	char request[64], line[256];
+	int length = sprintf(request, "PX %d %d\n", pixelsWidth - 1, pixelsHeight - 1);
+	if (!probeWrite(request, length))
+		return -1;
+	for (int attempt = 0; attempt < 4 && probeRead(line, sizeof(line)); attempt++)
+	{
+		int x, y;
+		char color[16];
+		if (sscanf(line, "PX %d %d %15s", &x, &y, color) == 3 && x == pixelsWidth - 1 && y == pixelsHeight - 1)
+			return (int)(strtoul(color, NULL, 16) >> (strlen(color) == 8 ? 8 : 0));
+	}
+	return -1; // error messages only
+}
+
+// Writes the corner pixel in the rrggbb and gg forms and reads it back to see which the server
+// understands. Servers that drop the connection over a form they do not know are reconnected.
+static void detectColorForms()
+{
+	colorForms = 0;
+	fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL, 0) & (~O_NONBLOCK));
+	char command[64];
+	int original = detectRead();
+	if (original >= 0)
+	{
+		sprintf(command, "PX %d %d 123456\n", pixelsWidth - 1, pixelsHeight - 1);
+		if (probeWrite(command, strlen(command)) && detectRead() == 0x123456)
+			colorForms |= FORM_RGB;
+		else
+			flutConnect();
+		fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL, 0) & (~O_NONBLOCK));
+		probeLineLength = 0;
+
+		sprintf(command, "PX %d %d 7f\n", pixelsWidth - 1, pixelsHeight - 1);
+		if (probeWrite(command, strlen(command)) && detectRead() == 0x7f7f7f)
+			colorForms |= FORM_GRAY;
+		else
+			flutConnect();
+		fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL, 0) & (~O_NONBLOCK));
+		probeLineLength = 0;
+
+		sprintf(command, "PX %d %d %06xff\n", pixelsWidth - 1, pixelsHeight - 1, original);
+		probeWrite(command, strlen(command));
+	}
+	if (!(colorForms & FORM_RGB))
+		colorForms = 0; // gray alone would not be used
+	printf("Color forms: rrggbbaa%s%s\n", colorForms & FORM_RGB ? ", rrggbb" : "", colorForms & FORM_GRAY ? ", gg" : "");
+	fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL, 0) | O_NONBLOCK);
+}
+
+#define BUFFER_SIZE (64 * 1024)
+#define MAX_PIXEL_COMMAND 32 // "PX xxxxx yyyyy rrggbbaa\n" with room to spare
+typedef struct
+{
+	unsigned char *data, *p;
+	size_t size;
+	int growable; // worker buffers grow, the others are submitted to their lane when full
+	int lane;
+} outbuf_t;
+static unsigned char sendData[BUFFER_SIZE];
+static outbuf_t sendBuffer = { sendData, sendData, BUFFER_SIZE, 0, LANE_INTERACTIVE };
+static __thread outbuf_t *out = &sendBuffer; // where the span API of this thread puts its commands
+
+static void outSubmit(outbuf_t *o)
+{
+	lanePush(o->lane, o->data, o->p - o->data);
+	o->p = o->data;
+}
+
+static void outReserve(outbuf_t *o, size_t required)
+{
+	size_t used = o->p - o->data;
+	if (o->size - used >= required)
+		return;
+	if (!o->growable)
+	{
+		outSubmit(o);
+		return;
+	}
+	o->size = o->size * 2 > used + required ? o->size * 2 : used + required;
+	o->data = realloc(o->data, o->size);
+	o->p = o->data + used;
+}
+
+static const unsigned char hex[] = "0123456789abcdef";
+static char hexPairs[256][2]; // both digits of every byte
+
+// length of the shortest form of color the server accepts
+static inline int colorLength(struct nk_color color)
+{
+	if (color.a == 255 && (colorForms & FORM_RGB))
+		return (colorForms & FORM_GRAY) && color.r == color.g && color.g == color.b ? 2 : 6;
+	return 8;
+}
+
+// writes rrggbbaa and returns how much of it is the shortest form the server accepts
+static inline int encodeColor(unsigned char *s, struct nk_color color)
+{
+	memcpy(s + 0, hexPairs[color.r], 2);
+	memcpy(s + 2, hexPairs[color.g], 2);
+	memcpy(s + 4, hexPairs[color.b], 2);
+	memcpy(s + 6, hexPairs[color.a], 2);
+	return colorLength(color);
+}
+
+// Queues PX commands for the pixels [x, x + n) of row y into this thread's output buffer: with colors each pixel has its own color,
+// otherwise all pixels share color and, with alphas, take their alpha from there (0 is skipped).
+// The y coordinate and the color are formatted once and x is counted up in decimal.
+static void encodeSpan(int x, int y, int n, struct nk_color color, const uint8_t *alphas, const struct nk_color *colors)
+{
+	char xs[16], ys[16];
+	int xlen = itoa(x, xs), ylen = itoa(y, ys);
+	ys[ylen++] = ' ';
+	unsigned char rgba[8], opaque[8];
+	int rgbaLength = encodeColor(rgba, color);
+	struct nk_color solid = color;
+	solid.a = 255;
+	int opaqueLength = encodeColor(opaque, solid);
+
+	outbuf_t *o = out;
+	for (int i = 0; i < n;)
+	{
+		outReserve(o, o->growable ? (n - i) * MAX_PIXEL_COMMAND : MAX_PIXEL_COMMAND);
+		int end = i + (int)((o->data + o->size - o->p) / MAX_PIXEL_COMMAND);
+		if (end > n)
+			end = n;
+		unsigned char *q = o->p;
+		for (; i < end; i++)
+		{
+			if (!alphas || alphas[i])
+			{
+				*q++ = 'P'; *q++ = 'X'; *q++ = ' ';
+				memcpy(q, xs, xlen); q += xlen; *q++ = ' ';
+				memcpy(q, ys, ylen); q += ylen;
+				if (colors)
+					q += encodeColor(q, colors[i]);
+				else if (!alphas)
+				{
+					memcpy(q, rgba, 8);
+					q += rgbaLength;
+				}
+				else if (alphas[i] == 255)
+				{
+					memcpy(q, opaque, 8);
+					q += opaqueLength;
+				}
+				else
+				{
+					memcpy(q, rgba, 6);
+					q[6] = hex[alphas[i] >> 4]; q[7] = hex[alphas[i] & 0xf];
+					q += 8;
+				}
+				*q++ = '\n';
+			}
+
+			// x + 1 in decimal
+			int d = xlen - 1;
+			while (d >= 0 && xs[d] == '9')
+				xs[d--] = '0';
+			if (d >= 0)
+				xs[d]++;
+			else
+			{
+				memmove(xs + 1, xs, xlen++);
+				xs[0] = '1';
+			}
+		}
+		o->p = q;
+	}
+}
+
+// Batch encoding of scattered pixels: colors are turned into hex several pixels at a time, then
+// each command is assembled from fixed size copies of "PX ", the prepared coordinate text and the
+// hex, advancing only by the lengths that count.
+#define ENCODE_BATCH 64
+typedef struct
+{
+	uint16_t x, y;
+	struct nk_color color;
+} pixel_t;
+
+static void hexColorsScalar(const pixel_t *batch, int n, unsigned char (*hexes)[8])
+{
+	for (int i = 0; i < n; i++)
+		encodeColor(hexes[i], batch[i].color);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// the colors of 4 pixels as 16 bytes, then both nibbles of each looked up with one shuffle
+__attribute__((target("ssse3")))
+static void hexColorsSSSE3(const pixel_t *batch, int n, unsigned char (*hexes)[8])
+{
+	const __m128i digits = _mm_loadu_si128((const __m128i*)hex), nibble = _mm_set1_epi8(0x0f);
+	const __m128i front = _mm_setr_epi8(4, 5, 6, 7, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1);
+	const __m128i back = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, 4, 5, 6, 7, 12, 13, 14, 15);
+	int i = 0;
+	for (; i + 4 <= n; i += 4)
+	{
+		__m128i a = _mm_loadu_si128((const __m128i*)(batch + i)), b = _mm_loadu_si128((const __m128i*)(batch + i + 2));
+		__m128i colors = _mm_or_si128(_mm_shuffle_epi8(a, front), _mm_shuffle_epi8(b, back));
+		__m128i high = _mm_shuffle_epi8(digits, _mm_and_si128(_mm_srli_epi16(colors, 4), nibble));
+		__m128i low = _mm_shuffle_epi8(digits, _mm_and_si128(colors, nibble));
+		_mm_storeu_si128((__m128i*)hexes[i], _mm_unpacklo_epi8(high, low));
+		_mm_storeu_si128((__m128i*)hexes[i + 2], _mm_unpackhi_epi8(high, low));
+	}
+	hexColorsScalar(batch + i, n - i, hexes + i);
+}
+
+// the same for 8 pixels; lane 0 holds pixels 0, 1, 4, 5 and lane 1 pixels 2, 3, 6, 7
+__attribute__((target("avx2")))
+static void hexColorsAVX2(const pixel_t *batch, int n, unsigned char (*hexes)[8])
+{
+	const __m256i digits = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)hex)), nibble = _mm256_set1_epi8(0x0f);
+	const __m256i front = _mm256_setr_epi8(4, 5, 6, 7, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1,
+		4, 5, 6, 7, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1);
+	const __m256i back = _mm256_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, 4, 5, 6, 7, 12, 13, 14, 15,
+		-1, -1, -1, -1, -1, -1, -1, -1, 4, 5, 6, 7, 12, 13, 14, 15);
+	int i = 0;
+	for (; i + 8 <= n; i += 8)
+	{
+		__m256i a = _mm256_loadu_si256((const __m256i*)(batch + i)), b = _mm256_loadu_si256((const __m256i*)(batch + i + 4));
+		__m256i colors = _mm256_or_si256(_mm256_shuffle_epi8(a, front), _mm256_shuffle_epi8(b, back));
+		__m256i high = _mm256_shuffle_epi8(digits, _mm256_and_si256(_mm256_srli_epi16(colors, 4), nibble));
+		__m256i low = _mm256_shuffle_epi8(digits, _mm256_and_si256(colors, nibble));
+		_mm256_storeu_si256((__m256i*)hexes[i], _mm256_unpacklo_epi8(high, low));
+		_mm256_storeu_si256((__m256i*)hexes[i + 4], _mm256_unpackhi_epi8(high, low));
+	}
+	hexColorsScalar(batch + i, n - i, hexes + i);
+}
+#endif
+
+static void (*hexColors)(const pixel_t *batch, int n, unsigned char (*hexes)[8]) = hexColorsScalar;
+
+// Queues PX commands for n pixels, all inside the canvas, into this thread's output buffer.
+static void encodePixels(const pixel_t *batch, int n)
+{
+	unsigned char hexes[ENCODE_BATCH][8];
+	outbuf_t *o = out;
+	for (int i = 0; i < n; i += ENCODE_BATCH)
+	{
+		int count = n - i < ENCODE_BATCH ? n - i : ENCODE_BATCH;
+		hexColors(batch + i, count, hexes);
+		outReserve(o, count * MAX_PIXEL_COMMAND);
+		unsigned char *q = o->p;
+		for (int j = 0; j < count; j++)
+		{
+			const pixel_t *p = &batch[i + j];
+			memcpy(q, "PX ", 3); q += 3;
+			memcpy(q, coordText[p->x], 8); q += coordText[p->x][7]; *q++ = ' ';
+			memcpy(q, coordText[p->y], 8); q += coordText[p->y][7]; *q++ = ' ';
+			memcpy(q, hexes[j], 8); q += colorLength(p->color); *q++ = '\n';
+		}
+		o->p = q;
+	}
+}
+
+static int hexCheck(void (*kernel)(const pixel_t *batch, int n, unsigned char (*hexes)[8]))
+{
+	enum { N = 1021 };
+	pixel_t batch[N];
+	unsigned char hexes[N][8], ref[N][8];
+	rng_t testRng;
+	rngSeed(&testRng, 1, 2);
+	for (int i = 0; i < N; i++)
+	{
+		uint32_t r = rngNext(&testRng);
+		batch[i].x = i; batch[i].y = r >> 16;
+		batch[i].color = nk_rgba(r, r >> 8, i < 256 ? i : r >> 16, i < 512 ? 255 : r >> 24);
+	}
+	kernel(batch, N, hexes);
+	hexColorsScalar(batch, N, ref);
+	return !memcmp(hexes, ref, sizeof(ref));
+}
+
+// a command in the shortest color form, written the plain way for the checks below
+static int encodeReference(char *s, int x, int y, struct nk_color c)
+{
+	if (c.a == 255 && (colorForms & FORM_RGB) && (colorForms & FORM_GRAY) && c.r == c.g && c.g == c.b)
+		return sprintf(s, "PX %d %d %02x\n", x, y, c.r);
+	if (c.a == 255 && (colorForms & FORM_RGB))
+		return sprintf(s, "PX %d %d %02x%02x%02x\n", x, y, c.r, c.g, c.b);
+	return sprintf(s, "PX %d %d %02x%02x%02x%02x\n", x, y, c.r, c.g, c.b, c.a);
+}
+
+// the encoders must write what encodeReference() does, in every combination of color forms
+static int encodeCheck()
+{
+	int passed = 1;
+	enum { N = 300, X = 850 }; // x counts past 999
+	outbuf_t buffer = { NULL, NULL, 0, 1, LANE_NORMAL }, *saved = out;
+	int savedForms = colorForms;
+	char *ref = malloc(N * MAX_PIXEL_COMMAND);
+	uint8_t alphas[N];
+	struct nk_color colors[N];
+	pixel_t batch[N];
+	rng_t testRng;
+	rngSeed(&testRng, 3, 4);
+	out = &buffer;
+	int width = pixelsWidth; // readSize() sets the coordinates up again for the server's canvas
+	if (pixelsWidth < X + N)
+		pixelsWidth = X + N;
+	coordInit();
+	pixelsWidth = width;
+	for (colorForms = 0; colorForms <= (FORM_RGB | FORM_GRAY); colorForms++)
+		for (int k = 0; k < 16; k++)
+		{
+			// gray and other colors, opaque and translucent, with and without alphas
+			uint32_t r = rngNext(&testRng);
+			struct nk_color color = k & 1 ? nk_rgba(r, r, r, r >> 24) : nk_rgba(r, r >> 8, r >> 16, r >> 24);
+			if (k & 2)
+				color.a = 255;
+			int y = r % 1000, length = 0;
+			for (int i = 0; i < N; i++)
+			{
+				uint32_t a = rngNext(&testRng);
+				alphas[i] = k & 4 ? color.a : a & 1 ? 255 : a & 2 ? 0 : a >> 24;
+				if (alphas[i] || k & 4)
+					length += encodeReference(ref + length, X + i, y, nk_rgba(color.r, color.g, color.b, alphas[i]));
+			}
+			buffer.p = buffer.data;
+			encodeSpan(X, y, N, color, k & 4 ? NULL : alphas, NULL);
+			if (buffer.p - buffer.data != length || memcmp(buffer.data, ref, length))
+			{
+				fprintf(stderr, "encodeSpan does not match the plain command form (color forms %d)\n", colorForms);
+				passed = 0;
+			}
+
+			// the same pixels with their own colors, as a span and as scattered pixels
+			length = 0;
+			for (int i = 0; i < N; i++)
+			{
+				uint32_t c = rngNext(&testRng);
+				colors[i] = c & 1 ? nk_rgba(c >> 8, c >> 8, c >> 8, c & 2 ? 255 : c >> 24) : nk_rgba(c >> 8, c >> 16, c >> 24, c & 2 ? 255 : c);
+				batch[i].x = X + i; batch[i].y = y; batch[i].color = colors[i];
+				length += encodeReference(ref + length, X + i, y, colors[i]);
+			}
+			buffer.p = buffer.data;
+			encodeSpan(X, y, N, color, NULL, colors);
+			int spanLength = buffer.p - buffer.data;
+			encodePixels(batch, N);
+			if (spanLength != length || buffer.p - buffer.data != 2 * length ||
+				memcmp(buffer.data, ref, length) || memcmp(buffer.data + length, ref, length))
+			{
+				fprintf(stderr, "encodePixels or encodeSpan does not match the plain command form (color forms %d)\n", colorForms);
+				passed = 0;
+			}
+		}
+	out = saved;
+	colorForms = savedForms;
+	free(ref);
+	free(buffer.data);
+	return passed;
+}
+
+static void encodeInit()
+{
+	for (int i = 0; i < 256; i++)
+	{
+		hexPairs[i][0] = hex[i >> 4];
+		hexPairs[i][1] = hex[i & 0xf];
+	}
+
+	#if defined(__x86_64__) || defined(__i386__)
+	if (__builtin_cpu_supports("avx2"))
+		hexColors = hexColorsAVX2;
+	else if (__builtin_cpu_supports("ssse3"))
+		hexColors = hexColorsSSSE3;
+	#endif
+
+	if (!hexCheck(hexColors))
+	{
+		fprintf(stderr, "SIMD hex encoding does not match the reference, using scalar encoding.\n");
+		hexColors = hexColorsScalar;
+	}
+}
+
+// -t: checks every kernel this CPU can run against its scalar reference, and the encoders against
+// the plain command form; returns the number of failures
+static int selfTestResult(const char *name, int passed)
+{
+	printf("%-22s %s\n", name, passed ? "ok" : "FAILED");
+	return !passed;
+}
+
+static int selfTest()
+{
+	int failed = 0;
+	#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse2"))
+	{
+		failed += selfTestResult("blendBytesSSE2", blendCheck(blendBytesSSE2));
+		failed += selfTestResult("firstDifferenceSSE2", firstDifferenceCheck(firstDifferenceSSE2));
+	}
+	if (__builtin_cpu_supports("ssse3"))
+		failed += selfTestResult("hexColorsSSSE3", hexCheck(hexColorsSSSE3));
+	if (__builtin_cpu_supports("avx2"))
+	{
+		failed += selfTestResult("blendBytesAVX2", blendCheck(blendBytesAVX2));
+		failed += selfTestResult("firstDifferenceAVX2", firstDifferenceCheck(firstDifferenceAVX2));
+		failed += selfTestResult("hexColorsAVX2", hexCheck(hexColorsAVX2));
+	}
+	#endif
+	failed += selfTestResult("encodeSpan", encodeCheck());
+	return failed;
+}
+
+// clips the span [*x, *x + *n) of row y to the canvas, returns the number of pixels cut off
+// at the start or -1 if nothing is left
+static int clipSpan(int *x, int y, int *n)
+{
+	if (y < 0 || y >= pixelsHeight)
+		return -1;
+	int skip = *x < 0 ? -*x : 0;
+	*x += skip;
+	*n -= skip;
+	if (*x + *n > pixelsWidth)
+		*n = pixelsWidth - *x;
+	return *n > 0 ? skip : -1;
+}
+
+// Speculative pixels are sent but not blended into the local canvas. Each one stays marked (1)
+// until predictionCorrect() restores it from the local canvas, unless a real stroke covers it
+// opaquely first (2).
+static uint8_t *speculative; // one mark per canvas pixel
+static uint32_t *speculativeList; // indices of the marked pixels
+static int speculativeCount = 0, speculativeCapacity = 0;
+static uint8_t *refineMarks; // faint pixels left out by adaptive quality, cleared when painted over
+static int refineMarking = 0;
+
+// Every pixel we paint opaque is marked as ours, and its tile remembers the frame it was last drawn in,
+// through each lane. Tiles are one stroke band high, so the workers never share one.
+#define TILE_W 32
+#define TILE_H 8
+typedef struct
+{
+	uint32_t drawn, checked; // frame numbers
+	float heat; // damage found by recent checks
+	uint8_t owned, pending;
+	uint32_t lanes[LANE_COUNT]; // frame each lane last wrote the tile in
+} tile_t;
+static uint8_t *owned;
+static tile_t *tiles;
+static int tilesX = 0;
+static uint32_t frameNumber = 1;
+
+// Lanes reorder writes: an older write still queued in a lane that is sent later can reach the
+// server after a newer write to the same pixel, and the wall then differs from the local canvas
+// until defense repairs it. Holding lanes back by tile would let bulk jobs stall strokes, so that
+// is accepted; but what the server has in such a tile is unknown, so its pixels are neither
+// suppressed nor pre-blended while another lane may still hold writes to it.
+static uint32_t laneDrained[LANE_COUNT]; // the lane had sent everything written before this frame
+
+static inline int tileQueued(const tile_t *tile, int lane)
+{
+	return tile->lanes[lane] && tile->lanes[lane] >= laneDrained[lane];
+}
+
+// whether every write to the tile has left its lane, so a readback queued now is answered after them
+static int tileSettled(const tile_t *tile)
+{
+	for (int l = 0; l < LANE_COUNT; l++)
+		if (tileQueued(tile, l))
+			return 0;
+	return 1;
+}
+
+// marks the tiles of a span as written through lane, for writes that do not make pixels ours
+static void tilesWritten(int lane, int x, int y, int n)
+{
+	for (int tx = x / TILE_W; tx <= (x + n - 1) / TILE_W; tx++)
+		tiles[(y / TILE_H) * tilesX + tx].lanes[lane] = frameNumber;
+}
+
+// whether a lane other than lane may still hold writes to one of the tiles of a span
+static int tilesMixed(int x, int y, int n, int lane)
+{
+	for (int tx = x / TILE_W; tx <= (x + n - 1) / TILE_W; tx++)
+		for (int l = 0; l < LANE_COUNT; l++)
+			if (l != lane && tileQueued(&tiles[(y / TILE_H) * tilesX + tx], l))
+				return 1;
+	return 0;
+}
+
+// Redundant writes: sent holds the color each pixel has on the server as far as we know, and
+// sentEpoch the second it was learned (counting 1..255 and wrapping, 0 when unknown). Opaque pixels
+// the server already has are dropped; knowledge older than suppressSeconds is not trusted.
+static uint8_t *sent, *sentEpoch;
+static uint8_t epochNow = 1;
+static int suppressSeconds = 10; // 0: off
+static uint64_t suppressed = 0;
+
+static uint8_t *held = NULL; // pixels a held blob keeps setting behind our back
+
+static inline int sentFresh(size_t p)
+{
+	return sentEpoch[p] && (uint8_t)(epochNow - sentEpoch[p]) < suppressSeconds && !(held && held[p]);
+}
+
+static inline void sentSet(size_t p, uint8_t r, uint8_t g, uint8_t b)
+{
+	sent[p * 3 + 0] = r; sent[p * 3 + 1] = g; sent[p * 3 + 2] = b;
+	sentEpoch[p] = epochNow;
+}
+
+// nothing is tracked while suppression is off, so turning it on starts from scratch
+static void suppressSet(int seconds)
+{
+	if (!suppressSeconds && seconds)
+		memset(sentEpoch, 0, (size_t)pixelsWidth * pixelsHeight);
+	suppressSeconds = seconds;
+}
+
+// once per second; forgets what was learned 255 seconds ago before its epoch comes around again
+static void sentTick()
+{
+	if (++epochNow == 0)
+		epochNow = 1;
+	size_t count = (size_t)pixelsWidth * pixelsHeight;
+	for (uint8_t *p = sentEpoch; (p = memchr(p, epochNow, sentEpoch + count - p)); p++)
+		*p = 0;
+}
+
+// Fills send with a mask of the n pixels at (x, y) that must be sent through lane, and blended with
+// their colors, and updates what the server will have. Translucent pixels over a known color are
+// blended here and sent opaque, which the server accepts in a shorter form. Datagrams of record
+// lanes may be lost, so what they send is never taken as known. Returns nonzero if send and blended
+// differ from the plain span.
+static int suppressSpan(int lane, int x, int y, int n, struct nk_color color, const uint8_t *alphas,
+	const struct nk_color *colors, uint8_t *send, struct nk_color *blended)
+{
+	int dropped = 0, changed = 0, reliable = !lanes[lane].record;
+	size_t p = (size_t)y * pixelsWidth + x;
+	if (tilesMixed(x, y, n, lane))
+	{
+		memset(sentEpoch + p, 0, n);
+		return 0;
+	}
+	for (int i = 0; i < n; i++, p++)
+	{
+		struct nk_color c = colors ? colors[i] : color;
+		uint8_t a = colors ? c.a : (alphas ? alphas[i] : color.a);
+		send[i] = a;
+		blended[i] = c;
+		blended[i].a = a;
+		if (!a)
+			continue;
+		uint8_t *s = sent + p * 3;
+		if (!sentFresh(p))
+		{
+			if (a == 255 && reliable)
+				sentSet(p, c.r, c.g, c.b);
+			else
+				sentEpoch[p] = 0;
+		}
+		else if (a < 255 && (colorForms & FORM_RGB) && reliable)
+		{
+			s[0] = blend8(s[0], c.r, a); s[1] = blend8(s[1], c.g, a); s[2] = blend8(s[2], c.b, a);
+			blended[i] = nk_rgba(s[0], s[1], s[2], 255);
+			changed = 1;
+		}
+		else if (a < 255)
+			sentEpoch[p] = 0; // sent with alpha, the server blends with its own rounding
+		else if (s[0] == c.r && s[1] == c.g && s[2] == c.b)
+		{
+			send[i] = 0;
+			dropped++;
+		}
+		else if (reliable)
+			sentSet(p, c.r, c.g, c.b);
+		else
+			sentEpoch[p] = 0;
+	}
+	if (dropped)
+		__atomic_add_fetch(&suppressed, dropped, __ATOMIC_RELAXED);
+	return dropped || changed;
+}
+
+// only opaque writes make pixels ours: translucent ones blend over what the server has, which the
+// local canvas does not know, so defense must not repeat them as our colors
+static void ownSpan(int lane, int x, int y, int n, uint8_t alpha, const uint8_t *alphas)
+{
+	uint8_t *o = owned + y * pixelsWidth + x;
+	int opaque = 0;
+	if (alphas)
+	{
+		for (int i = 0; i < n; i++)
+			if (alphas[i] == 255)
+				o[i] = opaque = 1;
+	}
+	else if (alpha == 255)
+	{
+		memset(o, 1, n);
+		opaque = 1;
+	}
+	for (int tx = x / TILE_W; tx <= (x + n - 1) / TILE_W; tx++)
+	{
+		tile_t *tile = &tiles[(y / TILE_H) * tilesX + tx];
+		tile->owned |= opaque;
+		tile->drawn = tile->lanes[lane] = frameNumber;
+	}
+}
+
+static void speculateSpan(int x, int y, int n, struct nk_color color, const uint8_t *alphas)
+{
+	int skip = clipSpan(&x, y, &n);
+	if (skip < 0)
+		return;
+	alphas += skip;
+	encodeSpan(x, y, n, color, alphas, NULL);
+	tilesWritten(out->lane, x, y, n);
+	for (int i = 0; i < n; i++)
+	{
+		uint32_t index = y * pixelsWidth + x + i;
+		if (!alphas[i])
+			continue;
+		sentEpoch[index] = 0;
+		if (speculative[index])
+			continue;
+		if (speculativeCount == speculativeCapacity)
+		{
+			speculativeCapacity = speculativeCapacity ? speculativeCapacity * 2 : 4096;
+			speculativeList = realloc(speculativeList, speculativeCapacity * sizeof(uint32_t));
+		}
+		speculative[index] = 1;
+		speculativeList[speculativeCount++] = index;
+	}
+}
+
+// Span API: each call clips once, encodes the whole row and blends it into the local canvas.
+static void setSpanAlphas(int x, int y, int n, struct nk_color color, const uint8_t *alphas)
+{
+	int skip = clipSpan(&x, y, &n);
+	if (skip < 0)
+		return;
+	uint8_t send[n];
+	struct nk_color blended[n];
+	if (suppressSeconds && suppressSpan(out->lane, x, y, n, color, alphas + skip, NULL, send, blended))
+		encodeSpan(x, y, n, color, send, blended);
+	else
+		encodeSpan(x, y, n, color, alphas + skip, NULL);
+	blendSpanAlphas(pixels + (y * pixelsWidth + x) * 3, color, alphas + skip, n);
+	ownSpan(out->lane, x, y, n, 0, alphas + skip);
+	if (speculativeCount)
+	{
+		uint8_t *marks = speculative + y * pixelsWidth + x;
+		for (int i = 0; i < n; i++)
+			if (marks[i] && alphas[skip + i] == 255)
+				marks[i] = 2; // covered for real
+	}
+	if (refineMarking)
+	{
+		uint8_t *marks = refineMarks + y * pixelsWidth + x;
+		for (int i = 0; i < n; i++)
+			if (alphas[skip + i] == 255)
+				marks[i] = 0;
+	}
+}
+
+// Applies n scattered pixels (at most ENCODE_BATCH) to the local canvas like the span API and
+// collects those that must be sent through lane into kept, returns their number.
+static int applyPixels(int lane, const pixel_t *batch, int n, pixel_t *kept)
+{
+	int count = 0;
+	for (int i = 0; i < n; i++)
+	{
+		pixel_t p = batch[i];
+		if (p.x >= pixelsWidth || p.y >= pixelsHeight || !p.color.a)
+			continue;
+		size_t index = (size_t)p.y * pixelsWidth + p.x;
+		uint8_t *pixel = pixels + index * 3;
+		pixel[0] = blend8(pixel[0], p.color.r, p.color.a);
+		pixel[1] = blend8(pixel[1], p.color.g, p.color.a);
+		pixel[2] = blend8(pixel[2], p.color.b, p.color.a);
+		ownSpan(lane, p.x, p.y, 1, p.color.a, NULL);
+		if (p.color.a == 255)
+		{
+			if (speculativeCount && speculative[index])
+				speculative[index] = 2;
+			if (refineMarking)
+				refineMarks[index] = 0;
+		}
+		uint8_t send;
+		if (suppressSeconds && suppressSpan(lane, p.x, p.y, 1, p.color, NULL, &batch[i].color, &send, &p.color) && !send)
+			continue;
+		kept[count++] = p;
+	}
+	return count;
+}
+
+// Batch API: like the span API for each of n scattered pixels, but encoded together.
+static void setPixels(const pixel_t *batch, int n)
+{
+	pixel_t kept[ENCODE_BATCH];
+	for (int i = 0; i < n; i += ENCODE_BATCH)
+		encodePixels(kept, applyPixels(out->lane, batch + i, n - i < ENCODE_BATCH ? n - i : ENCODE_BATCH, kept));
+}
+
+// Bulk orderings: the order in which the pixels of a rectangle are sent. Interlaced sends the
+// Adam7 passes, so a coarse grid appears first; the space filling curves keep neighbours close
+// together; random is a keyed Feistel permutation. Every order is computed pixel by pixel.
+enum { ORDER_ROWS, ORDER_INTERLACED, ORDER_HILBERT, ORDER_Z, ORDER_RANDOM, ORDER_COUNT };
+static const char *orderNames[ORDER_COUNT] = { "Rows", "Interlaced", "Hilbert Curve", "Z-Order", "Random" };
+static int bulkOrder = ORDER_ROWS;
+typedef struct
+{
+	int kind;
+	int x, y, w, h;
+	uint64_t index, count; // position in the rows, the curve or the permutation domain
+	int bits; // log2 of the curve's side, half the bits of the permutation domain
+	uint32_t keys[4];
+	int pass, px, py; // interlaced
+} order_t;
+static const int adam7[7][4] = { // x, y, dx, dy
+	{ 0, 0, 8, 8 }, { 4, 0, 8, 8 }, { 0, 4, 4, 8 }, { 2, 0, 4, 4 }, { 0, 2, 2, 4 }, { 1, 0, 2, 2 }, { 0, 1, 1, 2 } };
+
+static void orderInit(order_t *o, int kind, int x, int y, int w, int h)
+{
+	memset(o, 0, sizeof(*o));
+	o->kind = kind;
+	o->x = x; o->y = y; o->w = w; o->h = h;
+	o->count = (uint64_t)w * h;
+	if (kind == ORDER_HILBERT || kind == ORDER_Z)
+	{
+		while ((1 << o->bits) < w || (1 << o->bits) < h)
+			o->bits++;
+		o->count = (uint64_t)1 << (2 * o->bits);
+	}
+	else if (kind == ORDER_RANDOM)
+	{
+		o->bits = 1;
+		while (((uint64_t)1 << (2 * o->bits)) < o->count)
+			o->bits++;
+		for (int i = 0; i < 4; i++)
+			o->keys[i] = rngNext(&rng);
+	}
+}
+
+static void hilbertPoint(int bits, uint64_t d, int *x, int *y)
+{
+	*x = *y = 0;
+	for (int s = 1; s < (1 << bits); s *= 2, d /= 4)
+	{
+		int rx = 1 & (int)(d / 2), ry = 1 & (int)(d ^ rx);
+		if (!ry)
+		{
+			if (rx)
+			{
+				*x = s - 1 - *x;
+				*y = s - 1 - *y;
+			}
+			int t = *x; *x = *y; *y = t;
+		}
+		*x += s * rx;
+		*y += s * ry;
+	}
+}
+
+static void mortonPoint(int bits, uint64_t d, int *x, int *y)
+{
+	*x = *y = 0;
+	for (int i = 0; i < bits; i++)
+	{
+		*x |= (int)((d >> (2 * i)) & 1) << i;
+		*y |= (int)((d >> (2 * i + 1)) & 1) << i;
+	}
+}
+
+static uint64_t orderPermute(const order_t *o, uint64_t i)
+{
+	uint32_t mask = (1u << o->bits) - 1, l = (uint32_t)(i >> o->bits), r = (uint32_t)i & mask;
+	for (int round = 0; round < 4; round++)
+	{
+		uint32_t f = (r ^ o->keys[round]) * 0x9e3779b1u;
+		f ^= f >> 15;
+		f *= 0x85ebca77u;
+		f ^= f >> 13;
+		uint32_t t = l ^ (f & mask);
+		l = r;
+		r = t;
+	}
+	return ((uint64_t)l << o->bits) | r;
+}
+
+// the next pixel of the rectangle, 0 when all were visited
+static int orderNext(order_t *o, int *x, int *y)
+{
+	if (o->kind == ORDER_INTERLACED)
+	{
+		while (o->pass < 7)
+		{
+			const int *p = adam7[o->pass];
+			if (o->px >= o->w)
+			{
+				o->px = p[0];
+				o->py += p[3];
+			}
+			if (o->py >= o->h || p[0] >= o->w)
+			{
+				if (++o->pass < 7)
+				{
+					o->px = adam7[o->pass][0];
+					o->py = adam7[o->pass][1];
+				}
+				continue;
+			}
+			*x = o->x + o->px;
+			*y = o->y + o->py;
+			o->px += p[2];
+			return 1;
+		}
+		return 0;
+	}
+	while (o->index < o->count)
+	{
+		uint64_t i = o->index++;
+		int px, py;
+		switch (o->kind)
+		{
+		case ORDER_HILBERT: hilbertPoint(o->bits, i, &px, &py); break;
+		case ORDER_Z: mortonPoint(o->bits, i, &px, &py); break;
+		case ORDER_RANDOM:
+			do // cycle walking keeps the permutation inside the rectangle
+				i = orderPermute(o, i);
+			while (i >= (uint64_t)o->w * o->h);
+			// fall through
+		default: px = (int)(i % o->w); py = (int)(i / o->w); break;
+		}
+		if (px < o->w && py < o->h) // the curves cover a square around the rectangle
+		{
+			*x = o->x + px;
+			*y = o->y + py;
+			return 1;
+		}
+		// 4^k aligned steps of either curve cover an aligned square of side 2^k: skip the largest
+		// one starting here that lies outside as a whole, so thin rectangles are not walked point
+		// by point over the whole square
+		int k = 0;
+		while (k < o->bits && !(i & (((uint64_t)4 << (2 * k)) - 1)) &&
+			(((px >> (k + 1)) << (k + 1)) >= o->w || ((py >> (k + 1)) << (k + 1)) >= o->h))
+			k++;
+		o->index = i + ((uint64_t)1 << (2 * k));
+	}
+	return 0;
+}
+
+// Bulk encoding: bulk jobs apply their pixels to the local canvas on the UI thread, which owns it,
+// and describe what has to be sent as runs in chunks. The chunks are encoded by a pool of encoder
+// threads with a deque each: an encoder takes its newest chunk and steals the oldest one of the
+// others when it runs dry. A finished chunk goes to its lane once all chunks made before it for the
+// same lane went there, or right away when it was made unordered.
+#define CHUNK_RUNS 4096
+#define MAX_ENCODERS 64
+#define MAX_CHUNKS 64 // in flight
+typedef struct
+{
+	uint16_t x, y, n; // a single pixel when n is 1
+	struct nk_color color;
+} run_t;
+typedef struct
+{
+	int lane, ordered;
+	uint64_t sequence; // in its lane
+	run_t runs[CHUNK_RUNS];
+	int count, pixels;
+	unsigned char *data; // the encoded commands
+	size_t length;
+} chunk_t;
+typedef struct
+{
+	pthread_mutex_t mutex;
+	chunk_t *items[MAX_CHUNKS];
+	int head, count;
+} deque_t;
+static deque_t deques[MAX_ENCODERS];
+static struct
+{
+	pthread_mutex_t mutex;
+	pthread_cond_t work, finished;
+	int count; // threads
+	int queued; // chunks in the deques not yet claimed by an encoder
+	int inFlight; // chunks not yet handed to their lane
+	int next; // deque for the next chunk
+} encoders = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0, 0, 0 };
+static struct
+{
+	pthread_mutex_t mutex;
+	uint64_t made, next;
+	chunk_t *done[MAX_CHUNKS];
+} handoff[LANE_COUNT];
+static int bulkOrdered = 1;
+
+static chunk_t *chunkNew(int lane)
+{
+	chunk_t *c = malloc(sizeof(chunk_t));
+	c->lane = lane;
+	c->count = c->pixels = 0;
+	return c;
+}
+
+// hands the chunk to the encoders, the caller must not touch it any more. Jobs ask chunksWanted()
+// first, this only waits when they made more chunks than there are places for.
+static void chunkSubmit(chunk_t *c)
+{
+	if (!c->count)
+	{
+		free(c);
+		return;
+	}
+	c->ordered = bulkOrdered;
+	c->sequence = handoff[c->lane].made++;
+	pthread_mutex_lock(&encoders.mutex);
+	while (encoders.inFlight == MAX_CHUNKS)
+		pthread_cond_wait(&encoders.finished, &encoders.mutex);
+	deque_t *d = &deques[encoders.next];
+	encoders.next = (encoders.next + 1) % encoders.count;
+	encoders.inFlight++;
+	pthread_mutex_unlock(&encoders.mutex);
+
+	pthread_mutex_lock(&d->mutex);
+	d->items[(d->head + d->count++) % MAX_CHUNKS] = c;
+	pthread_mutex_unlock(&d->mutex);
+
+	pthread_mutex_lock(&encoders.mutex);
+	encoders.queued++;
+	pthread_cond_signal(&encoders.work);
+	pthread_mutex_unlock(&encoders.mutex);
+}
+
+// appends a run, submitting the chunk and starting a new one when it is full
+static void chunkRun(chunk_t **c, int x, int y, int n, struct nk_color color)
+{
+	chunk_t *chunk = *c;
+	if (chunk->count == CHUNK_RUNS)
+	{
+		int lane = chunk->lane;
+		chunkSubmit(chunk);
+		*c = chunk = chunkNew(lane);
+	}
+	run_t *r = &chunk->runs[chunk->count++];
+	r->x = x; r->y = y; r->n = n;
+	r->color = color;
+	chunk->pixels += n;
+}
+
+// at the start of a frame: a lane that is empty, with no chunks on their way to it, has sent
+// everything written through it before
+static void lanesDrainedUpdate()
+{
+	for (int l = 0; l < LANE_COUNT; l++)
+	{
+		pthread_mutex_lock(&handoff[l].mutex);
+		int chunks = handoff[l].next != handoff[l].made;
+		pthread_mutex_unlock(&handoff[l].mutex);
+		if (!chunks && !laneQueued(l))
+			laneDrained[l] = frameNumber;
+	}
+}
+
+// whether bulk jobs may make more chunks
+static int chunksWanted(int lane)
+{
+	pthread_mutex_lock(&encoders.mutex);
+	int inFlight = encoders.inFlight;
+	pthread_mutex_unlock(&encoders.mutex);
+	return inFlight < encoders.count * 4 && inFlight < MAX_CHUNKS / 2 && laneQueued(lane) < lanes[lane].limit;
+}
+
+// Binary records for the UDP transport: x and y as little endian 16 bit numbers, then r, g, b, a.
+#define UDP_RECORD 8
+static void encodeRecords(const run_t *r)
+{
+	outbuf_t *o = out;
+	outReserve(o, (size_t)r->n * UDP_RECORD);
+	unsigned char *q = o->p;
+	for (int x = r->x; x < r->x + r->n; x++, q += UDP_RECORD)
+	{
+		q[0] = x; q[1] = x >> 8;
+		q[2] = r->y; q[3] = r->y >> 8;
+		q[4] = r->color.r; q[5] = r->color.g; q[6] = r->color.b; q[7] = r->color.a;
+	}
+	o->p = q;
+}
+
+static void chunkEncode(const chunk_t *c)
+{
+	if (lanes[c->lane].record)
+	{
+		for (int i = 0; i < c->count; i++)
+			encodeRecords(&c->runs[i]);
+		return;
+	}
+	pixel_t batch[ENCODE_BATCH];
+	int count = 0;
+	for (int i = 0; i < c->count; i++)
+	{
+		const run_t *r = &c->runs[i];
+		if (r->n == 1)
+		{
+			batch[count].x = r->x; batch[count].y = r->y;
+			batch[count].color = r->color;
+			if (++count < ENCODE_BATCH)
+				continue;
+		}
+		encodePixels(batch, count);
+		count = 0;
+		if (r->n > 1)
+			encodeSpan(r->x, r->y, r->n, r->color, NULL, NULL);
+	}
+	encodePixels(batch, count);
+}
+
+static void chunkHandoff(chunk_t *c)
+{
+	int lane = c->lane, finished = 0;
+	pthread_mutex_lock(&handoff[lane].mutex);
+	if (!c->ordered)
+	{
+		lanePush(lane, c->data, c->length);
+		c->length = 0; // only keeps its place so the ordered ones behind it can go
+	}
+	handoff[lane].done[c->sequence % MAX_CHUNKS] = c;
+	while ((c = handoff[lane].done[handoff[lane].next % MAX_CHUNKS]))
+	{
+		handoff[lane].done[handoff[lane].next++ % MAX_CHUNKS] = NULL;
+		if (c->length)
+			lanePush(lane, c->data, c->length);
+		free(c->data);
+		free(c);
+		finished++;
+	}
+	pthread_mutex_unlock(&handoff[lane].mutex);
+	pthread_mutex_lock(&encoders.mutex);
+	encoders.inFlight -= finished;
+	pthread_cond_signal(&encoders.finished);
+	pthread_mutex_unlock(&encoders.mutex);
+}
+
+static chunk_t *dequeTake(deque_t *d, int newest)
+{
+	chunk_t *c = NULL;
+	pthread_mutex_lock(&d->mutex);
+	if (d->count)
+	{
+		if (newest)
+			c = d->items[(d->head + --d->count) % MAX_CHUNKS];
+		else
+		{
+			c = d->items[d->head];
+			d->head = (d->head + 1) % MAX_CHUNKS;
+			d->count--;
+		}
+	}
+	pthread_mutex_unlock(&d->mutex);
+	return c;
+}
+
+static void *encoderThread(void *arg)
+{
+	int self = (int)(intptr_t)arg;
+	outbuf_t buffer = { NULL, NULL, 0, 1, LANE_BULK };
+	out = &buffer;
+	for (;;)
+	{
+		pthread_mutex_lock(&encoders.mutex);
+		while (!encoders.queued)
+			pthread_cond_wait(&encoders.work, &encoders.mutex);
+		encoders.queued--; // one of the chunks in the deques is ours now
+		pthread_mutex_unlock(&encoders.mutex);
+
+		chunk_t *c = dequeTake(&deques[self], 1);
+		for (int i = 1; !c; i++)
+			c = dequeTake(&deques[(self + i) % encoders.count], 0);
+		chunkEncode(c);
+		c->data = buffer.data;
+		c->length = buffer.p - buffer.data;
+		buffer.data = buffer.p = NULL;
+		buffer.size = 0;
+		chunkHandoff(c);
+	}
+	return NULL;
+}
+
+static void encodersInit(int count)
+{
+	for (int i = 0; i < LANE_COUNT; i++)
+		pthread_mutex_init(&handoff[i].mutex, NULL);
+	for (int i = 0; i < MAX_ENCODERS; i++)
+		pthread_mutex_init(&deques[i].mutex, NULL);
+	count = count < 1 ? 1 : (count > MAX_ENCODERS ? MAX_ENCODERS : count);
+	for (int i = 0; i < count; i++)
+	{
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, encoderThread, (void*)(intptr_t)i))
+			break;
+		pthread_detach(thread);
+		encoders.count = i + 1;
+	}
+	if (!encoders.count)
+	{
+		printf("Could not start an encoder thread.\n");
+		exit(1);
+	}
+}
+
+// Bulk span API: like the span API, but the commands are left to the encoders.
+static void bulkSpanColor(chunk_t **c, int x, int y, int n, struct nk_color color)
+{
+	if (clipSpan(&x, y, &n) < 0)
+		return;
+	uint8_t send[n];
+	struct nk_color blended[n];
+	if (suppressSeconds && suppressSpan((*c)->lane, x, y, n, color, NULL, NULL, send, blended))
+	{
+		for (int i = 0; i < n;)
+		{
+			int start = i;
+			for (i++; i < n && send[i] && send[start] && !memcmp(&blended[i], &blended[start], sizeof(blended[i])); i++);
+			if (send[start])
+				chunkRun(c, x + start, y, i - start, blended[start]);
+		}
+	}
+	else
+		chunkRun(c, x, y, n, color);
+	blendSpanColor(pixels + (y * pixelsWidth + x) * 3, color, n);
+	ownSpan((*c)->lane, x, y, n, color.a, NULL);
+	if (refineMarking && color.a == 255)
+		memset(refineMarks + y * pixelsWidth + x, 0, n);
+}
+
+static void bulkPixels(chunk_t **c, const pixel_t *batch, int n)
+{
+	pixel_t kept[ENCODE_BATCH];
+	for (int i = 0; i < n; i += ENCODE_BATCH)
+	{
+		int count = applyPixels((*c)->lane, batch + i, n - i < ENCODE_BATCH ? n - i : ENCODE_BATCH, kept);
+		for (int j = 0; j < count; j++)
+			chunkRun(c, kept[j].x, kept[j].y, 1, kept[j].color);
+	}
+}
+
+// Maps the blob at path for streaming once it turned out to fit the canvas and the server.
+static void blobOpen(const char *path)
+{
+	int fd = open(path, O_RDONLY);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(blob_header_t))
+	{
+		fprintf(stderr, "ERROR reading blob %s\n", path);
+		exit(1);
+	}
+	const unsigned char *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+	{
+		fprintf(stderr, "ERROR mapping blob %s\n", path);
+		exit(1);
+	}
+	blob_header_t header;
+	memcpy(&header, map, sizeof(header));
+	const char *problem = NULL;
+	if (memcmp(header.magic, BLOB_MAGIC, 8))
+		problem = "is no blob";
+	else if (header.offset < sizeof(header) || header.offset > (uint64_t)st.st_size ||
+		header.length > (uint64_t)st.st_size - header.offset || !header.length || map[header.offset + header.length - 1] != '\n')
+		problem = "is truncated";
+	else if ((int)header.width != pixelsWidth || (int)header.height != pixelsHeight)
+		problem = "was encoded for another canvas size";
+	else if (header.encoding & ~colorForms)
+		problem = "uses color forms the server does not accept";
+	if (problem)
+	{
+		fprintf(stderr, "ERROR blob %s %s\n", path, problem);
+		exit(1);
+	}
+	madvise((void*)map, st.st_size, MADV_SEQUENTIAL);
+	blob.fd = fd;
+	blob.map = map;
+	blob.begin = header.offset;
+	blob.end = header.offset + header.length;
+	blob.hold = 1;
+	printf("Holding blob %s: %ux%u at %u,%u, %llu KiB per loop\n", path, header.w, header.h, header.x, header.y,
+		(unsigned long long)header.length / 1024);
+}
+
+// shows the blob on the local canvas and keeps suppression from trusting what it covers
+static void blobApply()
+{
+	if (!blob.map)
+		return;
+	held = calloc(pixelsWidth * pixelsHeight, 1);
+	const char *p = (const char*)blob.map + blob.begin, *end = (const char*)blob.map + blob.end;
+	while (p < end)
+	{
+		// sscanf would measure the rest of the mapping, so each line is parsed from a copy
+		const char *newline = memchr(p, '\n', end - p);
+		size_t size = (newline ? newline : end) - p;
+		char line[64];
+		int fits = size < sizeof(line);
+		if (fits)
+		{
+			memcpy(line, p, size);
+			line[size] = '\0';
+		}
+		p += size + 1;
+		unsigned x, y;
+		char color[9];
+		if (!fits || sscanf(line, "PX %u %u %8[0-9a-fA-F]", &x, &y, color) != 3 || x >= (unsigned)pixelsWidth || y >= (unsigned)pixelsHeight)
+			continue;
+		uint32_t c = strtoul(color, NULL, 16);
+		int length = strlen(color);
+		struct nk_color rgba = length == 2 ? nk_rgba(c, c, c, 255) :
+			(length == 6 ? nk_rgba(c >> 16, (c >> 8) & 255, c & 255, 255) : nk_rgba(c >> 24, (c >> 16) & 255, (c >> 8) & 255, c & 255));
+		uint8_t *pixel = pixels + ((size_t)y * pixelsWidth + x) * 3;
+		pixel[0] = blend8(pixel[0], rgba.r, rgba.a);
+		pixel[1] = blend8(pixel[1], rgba.g, rgba.a);
+		pixel[2] = blend8(pixel[2], rgba.b, rgba.a);
+		held[(size_t)y * pixelsWidth + x] = 1;
+	}
+}
+
+// writes the pixels we own as a blob in the forms the server accepts, returns 0 on failure
+static int blobSave(const char *path)
+{
+	int x0 = pixelsWidth, y0 = pixelsHeight, x1 = -1, y1 = -1;
+	for (int y = 0; y < pixelsHeight; y++)
+		for (int x = 0; x < pixelsWidth; x++)
+			if (owned[(size_t)y * pixelsWidth + x])
+			{
+				if (x < x0) x0 = x;
+				if (x > x1) x1 = x;
+				if (y < y0) y0 = y;
+				y1 = y;
+			}
+	if (x1 < 0)
+		return 0;
+
+	blob_header_t header = { BLOB_MAGIC, pixelsWidth, pixelsHeight, x0, y0, x1 - x0 + 1, y1 - y0 + 1, colorForms, 4096, 0 };
+	outbuf_t buffer = { NULL, NULL, 0, 1, LANE_BULK };
+	outReserve(&buffer, header.offset);
+	memset(buffer.data, 0, header.offset);
+	buffer.p += header.offset;
+	outbuf_t *previous = out;
+	out = &buffer;
+	struct nk_color colors[x1 - x0 + 1];
+	for (int y = y0; y <= y1; y++)
+	{
+		const uint8_t *mine = owned + (size_t)y * pixelsWidth, *rgb = pixels + (size_t)y * pixelsWidth * 3;
+		for (int x = x0; x <= x1;)
+		{
+			int start = x;
+			for (; x <= x1 && mine[x]; x++)
+				colors[x - start] = nk_rgba(rgb[x * 3], rgb[x * 3 + 1], rgb[x * 3 + 2], 255);
+			if (x > start)
+				encodeSpan(start, y, x - start, nk_rgba(0, 0, 0, 0), NULL, colors);
+			else
+				x++;
+		}
+	}
+	out = previous;
+	header.length = buffer.p - buffer.data - header.offset;
+	memcpy(buffer.data, &header, sizeof(header));
+
+	// a blob that is being held stays intact under its old name until the new one is complete
+	char temporary[1024];
+	snprintf(temporary, sizeof(temporary), "%s.tmp", path);
+	FILE *file = fopen(temporary, "wb");
+	int ok = file && fwrite(buffer.data, 1, buffer.p - buffer.data, file) == (size_t)(buffer.p - buffer.data);
+	if (file)
+		ok = !fclose(file) && ok;
+	ok = ok && !rename(temporary, path);
+	free(buffer.data);
+	return ok;
+}
+
+struct
+{
+	struct nk_color color;
+	order_t order;
+	int active;
+} fillState = {0};
+static void fillRect(int x, int y, int w, int h, struct nk_color color)
+{
+	fillState.color = color;
+	orderInit(&fillState.order, bulkOrder, x, y, w, h);
+	fillState.active = w > 0 && h > 0;
+}
+// applies one row's worth of pixels and leaves their encoding to the encoders,
+// returns 0 when there was nothing to do
+static int fillStep()
+{
+	// only produce while the encoders and the bulk lane have room, waiting for it would stall the UI
+	if (!fillState.active || !chunksWanted(LANE_BULK))
+		return 0;
+	chunk_t *chunk = chunkNew(LANE_BULK);
+	order_t *o = &fillState.order;
+	if (o->kind == ORDER_ROWS)
+	{
+		bulkSpanColor(&chunk, o->x, o->y + (int)(o->index / o->w), o->w, fillState.color);
+		o->index += o->w;
+		fillState.active = o->index < o->count;
+	}
+	else
+	{
+		pixel_t batch[ENCODE_BATCH];
+		int x, y, count = 0;
+		for (int i = 0; i < o->w && (fillState.active = orderNext(o, &x, &y)); i++)
+		{
+			batch[count].x = x; batch[count].y = y;
+			batch[count].color = fillState.color;
+			if (++count == ENCODE_BATCH)
+			{
+				bulkPixels(&chunk, batch, count);
+				count = 0;
+			}
+		}
+		bulkPixels(&chunk, batch, count);
+	}
+	chunkSubmit(chunk);
+	return 1;
+}
+
+// A frame source shows RGB frames of w x h at (x, y) on the canvas and sends only the pixels that
+// differ from shown, which holds what was sent, also what the local canvas shows. A reconnect may
+// have lost what was sent, so after one the next frame is sent whole.
+typedef struct
+{
+	int w, h, x, y;
+	uint8_t *shown;
+	unsigned connection; // shown was sent over, 0 to send the next frame whole
+} source_t;
+
+typedef struct
+{
+	int tile, changed;
+} source_tile_t;
+
+static int sourceTileCompare(const void *a, const void *b)
+{
+	return ((const source_tile_t*)b)->changed - ((const source_tile_t*)a)->changed;
+}
+
+// centers frames of w x h on the canvas
+static void sourcePlace(source_t *s, int w, int h)
+{
+	s->w = w;
+	s->h = h;
+	s->x = w < pixelsWidth ? (pixelsWidth - w) / 2 : 0;
+	s->y = h < pixelsHeight ? (pixelsHeight - h) / 2 : 0;
+	free(s->shown);
+	s->shown = malloc((size_t)w * h * 3);
+	s->connection = 0;
+}
+
+static int sourceTileCount(const source_t *s)
+{
+	return ((s->w + TILE_W - 1) / TILE_W) * ((s->h + TILE_H - 1) / TILE_H);
+}
+
+// fills changed with the tiles in which frame differs from shown, most changed first, returns
+// their number. Only the part of the frame on the canvas counts.
+static int sourceDiff(source_t *s, const uint8_t *frame, source_tile_t *changed)
+{
+	unsigned connection = __atomic_load_n(&connections, __ATOMIC_ACQUIRE);
+	if (s->connection != connection)
+	{
+		for (size_t i = 0; i < (size_t)s->w * s->h * 3; i++)
+			s->shown[i] = ~frame[i]; // so that every pixel differs
+		s->connection = connection;
+	}
+	int tilesAcross = (s->w + TILE_W - 1) / TILE_W, tileCount = sourceTileCount(s), count = 0;
+	int visibleW = pixelsWidth - s->x < s->w ? pixelsWidth - s->x : s->w;
+	int visibleH = pixelsHeight - s->y < s->h ? pixelsHeight - s->y : s->h;
+	for (int t = 0; t < tileCount; t++)
+	{
+		int tx = (t % tilesAcross) * TILE_W, ty = (t / tilesAcross) * TILE_H;
+		int w = visibleW - tx < TILE_W ? visibleW - tx : TILE_W, h = visibleH - ty < TILE_H ? visibleH - ty : TILE_H;
+		int differing = 0;
+		for (int y = ty; y < ty + h; y++)
+		{
+			size_t row = ((size_t)y * s->w + tx) * 3;
+			const uint8_t *a = frame + row, *b = s->shown + row;
+			for (int i = firstDifference(a, b, w * 3) / 3; i < w; i++)
+				differing += memcmp(a + i * 3, b + i * 3, 3) != 0;
+		}
+		if (differing)
+		{
+			changed[count].tile = t;
+			changed[count++].changed = differing;
+		}
+	}
+	qsort(changed, count, sizeof(source_tile_t), sourceTileCompare);
+	return count;
+}
+
+// queues the changed pixels of a tile of the frame and makes them shown, returns their number
+static int sourceSendTile(source_t *s, chunk_t **c, const uint8_t *frame, int tile)
+{
+	int tilesAcross = (s->w + TILE_W - 1) / TILE_W;
+	int tx = (tile % tilesAcross) * TILE_W, ty = (tile / tilesAcross) * TILE_H;
+	int w = s->w - tx < TILE_W ? s->w - tx : TILE_W, h = s->h - ty < TILE_H ? s->h - ty : TILE_H;
+	int sent = 0;
+	for (int y = ty; y < ty + h && s->y + y < pixelsHeight; y++)
+	{
+		size_t row = (size_t)y * s->w + tx;
+		const uint8_t *want = frame + row * 3;
+		uint8_t *have = s->shown + row * 3;
+		int cx = s->x + tx, cy = s->y + y;
+		int n = pixelsWidth - cx < w ? pixelsWidth - cx : w;
+		for (int i = n > 0 ? firstDifference(want, have, n * 3) / 3 : 0; i < n;)
+		{
+			int start = i;
+			for (i++; i < n && !memcmp(want + i * 3, want + start * 3, 3) && memcmp(want + i * 3, have + i * 3, 3); i++);
+			chunkRun(c, cx + start, cy, i - start, nk_rgba(want[start * 3], want[start * 3 + 1], want[start * 3 + 2], 255));
+			if (tilesMixed(cx + start, cy, i - start, (*c)->lane))
+				memset(sentEpoch + (size_t)cy * pixelsWidth + cx + start, 0, i - start);
+			else
+				for (int j = start; j < i; j++)
+					sentSet((size_t)cy * pixelsWidth + cx + j, want[j * 3], want[j * 3 + 1], want[j * 3 + 2]);
+			memcpy(have + start * 3, want + start * 3, (i - start) * 3);
+			memcpy(pixels + ((size_t)cy * pixelsWidth + cx + start) * 3, want + start * 3, (i - start) * 3);
+			ownSpan((*c)->lane, cx + start, cy, i - start, 255, NULL);
+			if (refineMarking)
+				memset(refineMarks + (size_t)cy * pixelsWidth + cx + start, 0, i - start);
+			sent += i - start;
+			if (i < n)
+				i += firstDifference(want + i * 3, have + i * 3, (n - i) * 3) / 3;
+		}
+	}
+	return sent;
+}
+
+// Video source (-v file, - for stdin): a reader thread decodes Y4M, or raw RGB frames the size of
+// the canvas, at the stream's frame rate and always offers the newest frame. The video job diffs
+// it tile by tile against what was sent before and sends the changed pixels of the tiles that
+// changed most first, up to a per frame budget that follows what the link drained. While the
+// normal lane is still busy no frame is taken, so the frame rate drops instead of the backlog
+// growing.
+static struct
+{
+	FILE *file;
+	int seekable, y4m, chroma; // chroma: 420, 444 or 0 for mono
+	int w, h; // frame size
+	double fps;
+	pthread_mutex_t mutex;
+	uint8_t *decoded, *ready, *spare; // RGB frames
+	uint8_t *planes; // of the Y4M frame being read
+	int fresh, playing, ended;
+	uint64_t frames, dropped, sent, skipped;
+	double budget; // pixels per frame
+	int waited; // the lane was still busy when the last frame came
+	double lastTime; // of the last frame taken, with the lane's counters then
+	uint64_t lastPushed, lastTaken, lastSent;
+	source_t source;
+} video = { NULL, 0, 0, 420, 0, 0, 25.0, PTHREAD_MUTEX_INITIALIZER, NULL, NULL, NULL, NULL, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, { 0 } };
+
+static int videoHeader()
+{
+	char line[256];
+	int c, length = 0;
+	while ((c = fgetc(video.file)) != EOF && c != '\n')
+		if (length < (int)sizeof(line) - 1)
+			line[length++] = c;
+	line[length] = '\0';
+	for (char *token = strtok(line, " "); token; token = strtok(NULL, " "))
+	{
+		if (token[0] == 'W')
+			video.w = atoi(token + 1);
+		else if (token[0] == 'H')
+			video.h = atoi(token + 1);
+		else if (token[0] == 'F')
+		{
+			int num = 25, den = 1;
+			sscanf(token + 1, "%d:%d", &num, &den);
+			if (num > 0 && den > 0)
+				video.fps = (double)num / den;
+		}
+		else if (token[0] == 'C')
+		{
+			// 8 bit planes only: the 420 sitings differ too little to matter here
+			if (!strcmp(token, "Cmono"))
+				video.chroma = 0;
+			else if (!strcmp(token, "C444"))
+				video.chroma = 444;
+			else if (!strcmp(token, "C420") || !strcmp(token, "C420jpeg") || !strcmp(token, "C420paldv") || !strcmp(token, "C420mpeg2"))
+				video.chroma = 420;
+			else
+			{
+				fprintf(stderr, "ERROR video chroma %s is not supported, only 420, 444 and mono\n", token + 1);
+				exit(1);
+			}
+		}
+	}
+	return c != EOF && video.w > 0 && video.h > 0 && video.w <= 65535 && video.h <= 65535;
+}
+
+static inline uint8_t clamp8(int v)
+{
+	return v < 0 ? 0 : (v > 255 ? 255 : v);
+}
+
+// reads the next frame into video.decoded, returns 0 at the end of the stream
+static int videoRead()
+{
+	size_t pixelCount = (size_t)video.w * video.h;
+	if (!video.y4m)
+		return fread(video.decoded, 1, pixelCount * 3, video.file) == pixelCount * 3;
+	char tag[6];
+	if (fread(tag, 1, 5, video.file) != 5 || memcmp(tag, "FRAME", 5))
+		return 0;
+	for (int c; (c = fgetc(video.file)) != '\n';) // frame parameters
+		if (c == EOF)
+			return 0;
+	int cw = video.chroma == 420 ? (video.w + 1) / 2 : video.w, ch = video.chroma == 420 ? (video.h + 1) / 2 : video.h;
+	size_t planes = pixelCount + (video.chroma ? 2 * (size_t)cw * ch : 0);
+	if (fread(video.planes, 1, planes, video.file) != planes)
+		return 0;
+	const uint8_t *ys = video.planes, *us = ys + pixelCount, *vs = us + (size_t)cw * ch;
+	for (int y = 0; y < video.h; y++)
+	{
+		uint8_t *rgb = video.decoded + (size_t)y * video.w * 3;
+		for (int x = 0; x < video.w; x++, rgb += 3)
+		{
+			// BT.601 with studio range, in 16.16 fixed point
+			int l = 76309 * (ys[(size_t)y * video.w + x] - 16), u = 0, v = 0;
+			if (video.chroma)
+			{
+				size_t i = video.chroma == 420 ? (size_t)(y / 2) * cw + x / 2 : (size_t)y * cw + x;
+				u = us[i] - 128;
+				v = vs[i] - 128;
+			}
+			rgb[0] = clamp8((l + 104597 * v + 32768) >> 16);
+			rgb[1] = clamp8((l - 25675 * u - 53279 * v + 32768) >> 16);
+			rgb[2] = clamp8((l + 132201 * u + 32768) >> 16);
+		}
+	}
+	return 1;
+}
+
+static void *videoThread(void *arg)
+{
+	long dataStart = video.seekable ? ftell(video.file) : 0;
+	double start = monotonicTime();
+	for (uint64_t frame = 0;; frame++)
+	{
+		if (!videoRead())
+		{
+			if (!video.seekable || fseek(video.file, dataStart, SEEK_SET) || !videoRead())
+				break;
+			start = monotonicTime(); // loop short animations
+			frame = 0;
+		}
+		double wait = start + frame / video.fps - monotonicTime();
+		if (wait > 0)
+			usleep((useconds_t)(wait * 1e6));
+		else if (wait < -1.0)
+			start -= wait; // fell behind, e.g. a slow pipe, so do not hurry to catch up
+
+		pthread_mutex_lock(&video.mutex);
+		uint8_t *ready = video.ready;
+		video.ready = video.decoded;
+		video.decoded = ready;
+		video.dropped += video.fresh; // the video job never got to the previous one
+		video.fresh = 1;
+		video.frames++;
+		pthread_mutex_unlock(&video.mutex);
+	}
+	__atomic_store_n(&video.ended, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+static void videoOpen(const char *path)
+{
+	video.file = strcmp(path, "-") ? fopen(path, "rb") : stdin;
+	if (!video.file)
+	{
+		fprintf(stderr, "ERROR opening video %s\n", path);
+		exit(1);
+	}
+	video.seekable = video.file != stdin && !fseek(video.file, 0, SEEK_CUR);
+	int c = fgetc(video.file);
+	if (c == 'Y')
+	{
+		char magic[9];
+		video.y4m = fread(magic, 1, 8, video.file) == 8 && !memcmp(magic, "UV4MPEG2", 8);
+		if (!video.y4m || !videoHeader())
+		{
+			fprintf(stderr, "ERROR video %s is no Y4M stream\n", path);
+			exit(1);
+		}
+	}
+	else
+	{
+		ungetc(c, video.file);
+		video.w = pixelsWidth;
+		video.h = pixelsHeight;
+	}
+	size_t size = (size_t)video.w * video.h * 3;
+	video.decoded = malloc(size);
+	video.ready = malloc(size);
+	video.spare = malloc(size);
+	video.planes = malloc(size);
+	printf("Playing %s: %dx%d %s at %.2f fps\n", path, video.w, video.h, video.y4m ? "Y4M" : "raw RGB", video.fps);
+}
+
+static void videoStart()
+{
+	if (!video.file)
+		return;
+	sourcePlace(&video.source, video.w, video.h);
+	video.budget = (double)video.w * video.h;
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, videoThread, NULL))
+	{
+		fprintf(stderr, "ERROR creating the video thread\n");
+		exit(1);
+	}
+	pthread_detach(thread);
+}
+
+static int videoStep()
+{
+	if (!video.source.shown || !video.playing)
+		return 0;
+	pthread_mutex_lock(&video.mutex);
+	int fresh = video.fresh;
+	pthread_mutex_unlock(&video.mutex);
+	if (!fresh)
+		return 0;
+	// the link has not drained the last frame yet: wait for it, newer frames replace this one
+	if (!chunksWanted(LANE_NORMAL) || laneQueued(LANE_NORMAL))
+	{
+		video.waited = 1;
+		return 0;
+	}
+	pthread_mutex_lock(&video.mutex);
+	uint8_t *frame = video.ready;
+	video.ready = video.spare;
+	video.fresh = 0;
+	pthread_mutex_unlock(&video.mutex);
+
+	// while frames have to wait the budget is what the link drained per frame period since the
+	// last one, otherwise it grows
+	lane_t *l = &lanes[LANE_NORMAL];
+	pthread_mutex_lock(&l->mutex);
+	uint64_t pushed = l->pushed, taken = l->taken;
+	pthread_mutex_unlock(&l->mutex);
+	double now = monotonicTime();
+	if (video.waited && video.lastSent && pushed > video.lastPushed)
+	{
+		double bytesPerPixel = (double)(pushed - video.lastPushed) / video.lastSent;
+		video.budget = (taken - video.lastTaken) / (now - video.lastTime) / video.fps / bytesPerPixel;
+	}
+	else
+		video.budget *= 1.25;
+	double most = (double)video.w * video.h;
+	video.budget = video.budget < 1024 ? 1024 : (video.budget > most ? most : video.budget);
+	video.waited = 0;
+	video.lastTime = now;
+	video.lastTaken = taken;
+	video.lastPushed = pushed; // the frame before the last one is on its way by now
+
+	source_tile_t *changed = malloc(sourceTileCount(&video.source) * sizeof(source_tile_t));
+	int count = sourceDiff(&video.source, frame, changed);
+	chunk_t *chunk = chunkNew(LANE_NORMAL);
+	int sent = 0, i = 0;
+	for (; i < count && sent < video.budget; i++)
+		sent += sourceSendTile(&video.source, &chunk, frame, changed[i].tile);
+	chunkSubmit(chunk);
+	video.sent += sent;
+	video.lastSent = sent;
+	video.skipped += count - i; // still differ, so the next frame picks them up
+	free(changed);
+
+	pthread_mutex_lock(&video.mutex);
+	video.spare = frame;
+	pthread_mutex_unlock(&video.mutex);
+	return 1;
+}
+
+// Watched image source (-i file): a watcher thread decodes the file again whenever it was
+// rewritten, or renamed over, and offers the newest version. The image job diffs it tile by tile
+// against what was sent and sends the changed tiles, most changed first, a few per step; a newer
+// version or a reconnect starts over with a new diff. Only binary PPM and PGM files are read.
+#define IMAGE_STEP_PIXELS 16384
+static struct
+{
+	const char *path;
+	pthread_mutex_t mutex;
+	uint8_t *ready, *current; // RGB, the newest version and the one being sent
+	int readyW, readyH, fresh;
+	uint64_t versions, failed, sent, resends;
+	source_tile_t *changed; // tiles of current still to send
+	int count, next;
+	source_t source;
+} image = { NULL, PTHREAD_MUTEX_INITIALIZER, NULL, NULL, 0, 0, 0, 0, 0, 0, 0, NULL, 0, 0, { 0 } };
+
+// skips whitespace and comments, reads a header number
+static int ppmNumber(FILE *f)
+{
+	int c;
+	while ((c = fgetc(f)) == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '#')
+		if (c == '#')
+			while ((c = fgetc(f)) != EOF && c != '\n');
+	int n = 0;
+	for (; c >= '0' && c <= '9' && n < 1000000; c = fgetc(f))
+		n = n * 10 + c - '0';
+	return n; // the single whitespace after it is consumed
+}
+
+// decodes a binary PPM (P6) or PGM (P5) of up to 8 bits per sample to RGB, NULL if it is none
+static uint8_t *ppmLoad(const char *path, int *w, int *h)
+{
+	FILE *f = fopen(path, "rb");
+	if (!f)
+		return NULL;
+	int p = fgetc(f), type = fgetc(f);
+	*w = ppmNumber(f);
+	*h = ppmNumber(f);
+	int maxval = ppmNumber(f);
+	size_t pixelCount = (size_t)*w * *h, size = pixelCount * 3;
+	uint8_t *rgb = NULL;
+	if (p == 'P' && (type == '5' || type == '6') && *w > 0 && *h > 0 && *w <= 65535 && *h <= 65535 && maxval > 0 && maxval < 256)
+	{
+		rgb = malloc(size);
+		size_t samples = type == '6' ? size : pixelCount;
+		if (fread(rgb, 1, samples, f) != samples)
+		{
+			free(rgb);
+			rgb = NULL;
+		}
+		else
+		{
+			if (type == '5')
+				for (size_t i = pixelCount; i-- > 0;)
+					rgb[i * 3] = rgb[i * 3 + 1] = rgb[i * 3 + 2] = rgb[i];
+			if (maxval != 255)
+				for (size_t i = 0; i < size; i++)
+					rgb[i] = rgb[i] > maxval ? 255 : rgb[i] * 255 / maxval;
+		}
+	}
+	fclose(f);
+	return rgb;
+}
+
+static void imageLoad()
+{
+	int w, h;
+	uint8_t *rgb = ppmLoad(image.path, &w, &h);
+	pthread_mutex_lock(&image.mutex);
+	if (rgb)
+	{
+		free(image.ready);
+		image.ready = rgb;
+		image.readyW = w;
+		image.readyH = h;
+		image.fresh = 1;
+		image.versions++;
+	}
+	else
+		image.failed++; // e.g. not written yet, the next version will do
+	pthread_mutex_unlock(&image.mutex);
+}
+
+static void *imageThread(void *arg)
+{
+	imageLoad();
+	#ifdef __linux__
+	// watch the directory, so that a new file renamed over the old one is seen as well
+	char dir[4096];
+	const char *name = strrchr(image.path, '/');
+	if (name && name - image.path < (int)sizeof(dir))
+		snprintf(dir, sizeof(dir), "%.*s", name == image.path ? 1 : (int)(name - image.path), image.path);
+	else
+		strcpy(dir, ".");
+	name = name ? name + 1 : image.path;
+	int fd = inotify_init();
+	if (fd >= 0 && inotify_add_watch(fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) >= 0)
+	{
+		char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+		for (ssize_t n; (n = read(fd, events, sizeof(events))) > 0 || (n < 0 && errno == EINTR);)
+		{
+			int changed = 0;
+			for (char *e = events; n > 0 && e < events + n; e += sizeof(struct inotify_event) + ((struct inotify_event*)e)->len)
+				changed |= ((struct inotify_event*)e)->len && !strcmp(((struct inotify_event*)e)->name, name);
+			if (changed) // one decode for a burst of events
+				imageLoad();
+		}
+	}
+	fprintf(stderr, "ERROR watching %s, polling it instead\n", dir);
+	if (fd >= 0)
+		close(fd);
+	#endif
+	struct stat last = { 0 };
+	stat(image.path, &last);
+	for (;;)
+	{
+		usleep(500000);
+		struct stat now;
+		if (!stat(image.path, &now) && (now.st_mtime != last.st_mtime || now.st_size != last.st_size || now.st_ino != last.st_ino))
+		{
+			last = now;
+			imageLoad();
+		}
+	}
+	return NULL;
+}
+
+static void imageStart(const char *path)
+{
+	image.path = path;
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, imageThread, NULL))
+	{
+		fprintf(stderr, "ERROR creating the image thread\n");
+		exit(1);
+	}
+	pthread_detach(thread);
+}
+
+static int imageStep()
+{
+	if (!image.path)
+		return 0;
+	pthread_mutex_lock(&image.mutex);
+	int fresh = image.fresh;
+	pthread_mutex_unlock(&image.mutex);
+	unsigned connection = __atomic_load_n(&connections, __ATOMIC_ACQUIRE);
+	int reconnected = image.current && image.source.connection != connection;
+	if ((!fresh && !reconnected && image.next == image.count) || !chunksWanted(LANE_NORMAL))
+		return 0;
+	if (fresh)
+	{
+		pthread_mutex_lock(&image.mutex);
+		free(image.current);
+		image.current = image.ready;
+		image.ready = NULL;
+		int w = image.readyW, h = image.readyH;
+		image.fresh = 0;
+		pthread_mutex_unlock(&image.mutex);
+		if (w != image.source.w || h != image.source.h)
+		{
+			sourcePlace(&image.source, w, h);
+			free(image.changed);
+			image.changed = malloc(sourceTileCount(&image.source) * sizeof(source_tile_t));
+		}
+	}
+	if (fresh || reconnected)
+	{
+		image.resends += reconnected;
+		image.count = sourceDiff(&image.source, image.current, image.changed);
+		image.next = 0;
+	}
+	chunk_t *chunk = chunkNew(LANE_NORMAL);
+	int sent = 0;
+	while (image.next < image.count && sent < IMAGE_STEP_PIXELS)
+		sent += sourceSendTile(&image.source, &chunk, image.current, image.changed[image.next++].tile);
+	chunkSubmit(chunk);
+	image.sent += sent;
+	return 1;
+}
+
+// Gateway (-g path): other programs on the machine draw through this process' connection. Every
+// job becomes spans in an MPSC ring in shared memory (path.ring) that the gateway job drains into
+// bulk chunks, so gateway pixels go through suppression, the encoders and the lanes like our own.
+// Producers either write spans into the ring directly or send text commands to the Unix socket at
+// path, one thread per client:
+//   PX x y color, SPAN x y n color, FILL x y w h color (color is rrggbb, rrggbbaa or ww)
+//   IMAGE x y w h, followed by w * h * 3 bytes of RGB
+//   SIZE, answered with SIZE width height
+//   SYNC, answered with SYNC once everything sent before was drained from the ring
+// To write a span into the ring a producer takes a ticket by atomically incrementing head, waits
+// until ticket - tail < capacity, fills the record at ticket % capacity and then stores
+// ticket + 1 into its seq with release semantics. A producer that dies between taking a ticket
+// and publishing it stalls the ring.
+#define GATEWAY_RING 65536 // records
+#define GATEWAY_OFFSET 4096 // of the records in the file
+#define GATEWAY_STEP_PIXELS 65536
+typedef struct
+{
+	char magic[8]; // "PFRING1\n"
+	uint32_t capacity, offset, width, height;
+	uint64_t head __attribute__((aligned(64))); // tickets taken by producers
+	uint64_t tail __attribute__((aligned(64))); // records drained
+} ring_header_t;
+typedef struct
+{
+	uint32_t seq; // ticket + 1 once written, as seen from the low 32 bits
+	uint16_t x, y, n, reserved; // a span of n pixels
+	uint8_t r, g, b, a;
+} ring_record_t;
+static struct
+{
+	const char *path;
+	int listener;
+	ring_header_t *ring;
+	ring_record_t *records;
+	int clients;
+	uint64_t spans, pixels, commands, errors;
+	char ringPath[1024];
+} gateway = { NULL, -1, NULL, NULL, 0, 0, 0, 0, 0, "" };
+
+// writes a span into the ring as a producer, returns its ticket
+static uint64_t gatewayPush(int x, int y, int n, struct nk_color color)
+{
+	ring_header_t *ring = gateway.ring;
+	uint64_t ticket = __atomic_fetch_add(&ring->head, 1, __ATOMIC_RELAXED);
+	while (ticket - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= ring->capacity)
+		usleep(100);
+	ring_record_t *r = &gateway.records[ticket % ring->capacity];
+	r->x = x; r->y = y; r->n = n;
+	r->r = color.r; r->g = color.g; r->b = color.b; r->a = color.a;
+	__atomic_store_n(&r->seq, (uint32_t)(ticket + 1), __ATOMIC_RELEASE);
+	return ticket;
+}
+
+// pushes the part of a span that lies on the canvas, returns the last ticket or the given one
+static uint64_t gatewaySpan(int x, int y, int n, struct nk_color color, uint64_t ticket)
+{
+	if (y < 0 || y >= pixelsHeight || x >= pixelsWidth || n <= 0 || x <= -n || !color.a)
+		return ticket;
+	if (x < 0)
+	{
+		n += x;
+		x = 0;
+	}
+	if (n > pixelsWidth - x)
+		n = pixelsWidth - x;
+	return gatewayPush(x, y, n, color);
+}
+
+static int gatewayColor(const char *text, struct nk_color *color)
+{
+	char *end;
+	unsigned long c = strtoul(text, &end, 16);
+	switch (end - text)
+	{
+	case 2: *color = nk_rgba(c, c, c, 255); return 1;
+	case 6: *color = nk_rgba(c >> 16, (c >> 8) & 255, c & 255, 255); return 1;
+	case 8: *color = nk_rgba(c >> 24, (c >> 16) & 255, (c >> 8) & 255, c & 255); return 1;
+	default: return 0;
+	}
+}
+
+static void *gatewayClient(void *arg)
+{
+	int fd = (int)(intptr_t)arg, replyFd = dup(fd);
+	FILE *f = fdopen(fd, "r"), *reply = replyFd >= 0 ? fdopen(replyFd, "w") : NULL;
+	if (!f || !reply)
+	{
+		if (f)
+			fclose(f);
+		else
+			close(fd);
+		if (reply)
+			fclose(reply);
+		else if (replyFd >= 0)
+			close(replyFd);
+		return NULL;
+	}
+	char line[256], hex[16];
+	int x, y, w, h;
+	uint64_t last = 0; // ticket of this client's last span
+	int pushed = 0;
+	__atomic_add_fetch(&gateway.clients, 1, __ATOMIC_RELAXED);
+	while (fgets(line, sizeof(line), f))
+	{
+		struct nk_color color;
+		int ok = 1;
+		uint64_t before = last;
+		if (sscanf(line, "PX %d %d %15s", &x, &y, hex) == 3 && gatewayColor(hex, &color))
+			last = gatewaySpan(x, y, 1, color, last);
+		else if (sscanf(line, "SPAN %d %d %d %15s", &x, &y, &w, hex) == 4 && gatewayColor(hex, &color))
+			last = gatewaySpan(x, y, w, color, last);
+		else if (sscanf(line, "FILL %d %d %d %d %15s", &x, &y, &w, &h, hex) == 5 && gatewayColor(hex, &color))
+		{
+			for (int row = y < 0 ? 0 : y; row < pixelsHeight && row < (long)y + h; row++)
+				last = gatewaySpan(x, row, w, color, last);
+		}
+		else if (sscanf(line, "IMAGE %d %d %d %d", &x, &y, &w, &h) == 4 && w > 0 && h > 0 && w <= 65535 && h <= 65535)
+		{
+			uint8_t *row = malloc((size_t)w * 3);
+			for (int j = 0; j < h && (ok = fread(row, 1, (size_t)w * 3, f) == (size_t)w * 3); j++)
+			{
+				for (int i = 0; i < w;)
+				{
+					int start = i;
+					for (i++; i < w && !memcmp(row + i * 3, row + start * 3, 3); i++);
+					last = gatewaySpan(x + start, y + j, i - start, nk_rgba(row[start * 3], row[start * 3 + 1], row[start * 3 + 2], 255), last);
+				}
+			}
+			free(row);
+			if (!ok)
+				break;
+		}
+		else if (!strncmp(line, "SIZE", 4))
+			fprintf(reply, "SIZE %d %d\n", pixelsWidth, pixelsHeight);
+		else if (!strncmp(line, "SYNC", 4))
+		{
+			while (pushed && __atomic_load_n(&gateway.ring->tail, __ATOMIC_ACQUIRE) <= last)
+				usleep(1000);
+			fprintf(reply, "SYNC\n");
+		}
+		else
+			ok = 0;
+		pushed |= last != before;
+		__atomic_add_fetch(ok ? &gateway.commands : &gateway.errors, 1, __ATOMIC_RELAXED);
+		fflush(reply);
+	}
+	fclose(reply);
+	fclose(f);
+	__atomic_sub_fetch(&gateway.clients, 1, __ATOMIC_RELAXED);
+	return NULL;
+}
+
+static void *gatewayThread(void *arg)
+{
+	for (;;)
+	{
+		int fd = accept(gateway.listener, NULL, NULL);
+		if (fd < 0)
+		{
+			if (errno != EINTR && errno != ECONNABORTED)
+				usleep(100000);
+			continue;
+		}
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, gatewayClient, (void*)(intptr_t)fd))
+			close(fd);
+		else
+			pthread_detach(thread);
+	}
+	return NULL;
+}
+
+static void gatewayStop();
+static void gatewaySignal(int sig);
+
+static void gatewayStart(const char *path)
+{
+	gateway.path = path;
+	char *ringPath = gateway.ringPath;
+	snprintf(ringPath, sizeof(gateway.ringPath), "%s.ring", path);
+	size_t size = GATEWAY_OFFSET + GATEWAY_RING * sizeof(ring_record_t);
+	int fd = open(ringPath, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0 || ftruncate(fd, size) < 0 || (gateway.ring = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED)
+	{
+		fprintf(stderr, "ERROR creating the gateway ring %s\n", ringPath);
+		exit(1);
+	}
+	close(fd);
+	atexit(gatewayStop);
+	signal(SIGINT, gatewaySignal);
+	signal(SIGTERM, gatewaySignal);
+	gateway.records = (ring_record_t*)((char*)gateway.ring + GATEWAY_OFFSET);
+	gateway.ring->capacity = GATEWAY_RING;
+	gateway.ring->offset = GATEWAY_OFFSET;
+	gateway.ring->width = pixelsWidth;
+	gateway.ring->height = pixelsHeight;
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy(gateway.ring->magic, "PFRING1\n", 8); // last, so producers see a complete header
+
+	struct sockaddr_un address = { .sun_family = AF_UNIX };
+	if (strlen(path) >= sizeof(address.sun_path))
+	{
+		fprintf(stderr, "ERROR gateway path %s is too long\n", path);
+		exit(1);
+	}
+	strcpy(address.sun_path, path);
+	unlink(path);
+	gateway.listener = socket(AF_UNIX, SOCK_STREAM, 0);
+	// like the ring, only for our user; nobody can connect before listen()
+	if (gateway.listener < 0 || bind(gateway.listener, (struct sockaddr*)&address, sizeof(address)) < 0 ||
+		chmod(path, 0600) < 0 || listen(gateway.listener, 16) < 0)
+	{
+		fprintf(stderr, "ERROR listening on %s\n", path);
+		exit(1);
+	}
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, gatewayThread, NULL))
+	{
+		fprintf(stderr, "ERROR creating the gateway thread\n");
+		exit(1);
+	}
+	pthread_detach(thread);
+	printf("Gateway on %s, ring %s\n", path, ringPath);
+}
+
+// removes the socket and the ring on any exit; only unlink() so signal handlers may call it
+static void gatewayStop()
+{
+	const char *path = gateway.path;
+	if (!path)
+		return;
+	gateway.path = NULL;
+	unlink(path);
+	unlink(gateway.ringPath);
+}
+
+static void gatewaySignal(int sig)
+{
+	gatewayStop();
+	signal(sig, SIG_DFL);
+	raise(sig);
+}
+
+// drains published spans from the ring into chunks of the normal lane
+static int gatewayStep()
+{
+	if (!gateway.ring || !chunksWanted(LANE_NORMAL))
+		return 0;
+	ring_header_t *ring = gateway.ring;
+	uint64_t tail = ring->tail; // only this thread writes it
+	ring_record_t *r = &gateway.records[tail % ring->capacity];
+	if (__atomic_load_n(&r->seq, __ATOMIC_ACQUIRE) != (uint32_t)(tail + 1))
+		return 0;
+	chunk_t *chunk = chunkNew(LANE_NORMAL);
+	int pixels = 0;
+	do
+	{
+		bulkSpanColor(&chunk, r->x, r->y, r->n, nk_rgba(r->r, r->g, r->b, r->a));
+		pixels += r->n;
+		gateway.spans++;
+		r = &gateway.records[++tail % ring->capacity];
+	}
+	while (pixels < GATEWAY_STEP_PIXELS && __atomic_load_n(&r->seq, __ATOMIC_ACQUIRE) == (uint32_t)(tail + 1));
+	__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE); // the records may be reused now
+	chunkSubmit(chunk);
+	gateway.pixels += pixels;
+	return 1;
+}
+
+// Background jobs run in small resumable steps after the frame's interactive work, until the
+// frame's budget is spent. The job that used the least time this frame goes next. The budget
+// grows while jobs want more and shrinks when frames miss their deadline.
+#define MAX_JOBS 8
+typedef struct
+{
+	const char *name;
+	int (*step)(); // does a little work, returns 0 when there is nothing to do right now
+	double used; // seconds this frame
+	double share; // smoothed fraction of the budget
+} job_t;
+static job_t jobs[MAX_JOBS];
+static int jobCount = 0;
+static struct
+{
+	double budget; // seconds per frame
+	double frameStart;
+	int saturated; // last frame's jobs wanted more than the budget
+	double second; // when the last second began
+} scheduler = { 0.004, 0, 0, 0 };
+static int frameTargetMs = 16;
+
+static void jobAdd(const char *name, int (*step)())
+{
+	jobs[jobCount].name = name;
+	jobs[jobCount].step = step;
+	jobCount++;
+}
+
+// call at the start of each frame to adapt the budget to the last frame's duration
+static void schedulerFrame()
+{
+	const double minBudget = 0.0005;
+	double now = monotonicTime(), target = frameTargetMs / 1000.0;
+	if (scheduler.frameStart > 0)
+	{
+		double frameTime = now - scheduler.frameStart;
+		if (frameTime > target * 1.2)
+			scheduler.budget *= 0.75;
+		else if (scheduler.saturated)
+			scheduler.budget += 0.00025;
+		if (scheduler.budget < minBudget)
+			scheduler.budget = minBudget;
+		if (scheduler.budget > target * 0.75)
+			scheduler.budget = target * 0.75;
+	}
+	scheduler.frameStart = now;
+	frameNumber++;
+	lanesDrainedUpdate();
+	if (now - scheduler.second >= 1.0)
+	{
+		scheduler.second = now;
+		sentTick();
+	}
+}
+
+static void jobsRun()
+{
+	double start = monotonicTime(), now = start;
+	int idle[MAX_JOBS] = {0};
+	for (int i = 0; i < jobCount; i++)
+		jobs[i].used = 0;
+	scheduler.saturated = 0;
+	for (;;)
+	{
+		int next = -1;
+		for (int i = 0; i < jobCount; i++)
+			if (!idle[i] && (next < 0 || jobs[i].used < jobs[next].used))
+				next = i;
+		if (next < 0)
+			break;
+		if (now - start >= scheduler.budget)
+		{
+			scheduler.saturated = 1;
+			break;
+		}
+		idle[next] = !jobs[next].step();
+		double t = monotonicTime();
+		jobs[next].used += t - now;
+		now = t;
+	}
+	for (int i = 0; i < jobCount; i++)
+		jobs[i].share += 0.1 * (jobs[i].used / scheduler.budget - jobs[i].share);
+}
+
+#define MAX_BRUSH_SIZE 200
+typedef struct
+{
+	char name[64];
+	struct nk_color color;
+	nk_size size;
+	nk_size stabilization;
+	nk_size spray;
+	nk_size shape;
+	int sprayMask;
+	int smoothing; // SMOOTHING_*
+	float beta; // One Euro speed coefficient
+	int interpolate; // Catmull-Rom curves through the stabilized points
+} brush_t;
+enum { SMOOTHING_AVERAGE, SMOOTHING_EXPONENTIAL, SMOOTHING_ONE_EURO, SMOOTHING_COUNT };
+static const char *smoothingNames[SMOOTHING_COUNT] = { "Moving Average", "Exponential", "One Euro" };
+
+// Blue-noise threshold masks for spraying: a pixel is kept if its threshold is below 256 / spray.
+// The masks tile seamlessly, so one cached set serves every brush size. They are cycled from
+// segment to segment and anchored at the segment start, so a spray costs one lookup per pixel.
+#define SPRAY_MASK_BITS 6
+#define SPRAY_MASK_SIZE (1 << SPRAY_MASK_BITS)
+#define SPRAY_MASK_COUNT 8
+static uint8_t sprayMasks[SPRAY_MASK_COUNT][SPRAY_MASK_SIZE * SPRAY_MASK_SIZE];
+static int sprayMasksReady = 0, sprayMaskIndex = 0;
+static void sprayMasksInit()
+{
+	// Mitchell's best candidate on a torus: each new point is the candidate farthest from all
+	// points placed so far and gets the next threshold
+	#define SPRAY_MASK_CANDIDATES 12
+	const int n = SPRAY_MASK_SIZE * SPRAY_MASK_SIZE;
+	int *dist2 = malloc(n * sizeof(int));
+	int *unplaced = malloc(n * sizeof(int));
+	rng_t maskRng;
+	rngSeed(&maskRng, rngSeedValue, 0x5eed);
+	for (int m = 0; m < SPRAY_MASK_COUNT; m++)
+	{
+		for (int i = 0; i < n; i++)
+		{
+			dist2[i] = INT32_MAX;
+			unplaced[i] = i;
+		}
+		int reach = SPRAY_MASK_SIZE / 2;
+		for (int rank = 0; rank < n; rank++)
+		{
+			int left = n - rank, bestSlot = 0, bestDist2 = -1;
+			for (int c = 0; c < SPRAY_MASK_CANDIDATES && c < left; c++)
+			{
+				int slot = rngNext(&maskRng) % left;
+				if (dist2[unplaced[slot]] > bestDist2)
+				{
+					bestSlot = slot;
+					bestDist2 = dist2[unplaced[slot]];
+				}
+			}
+			int best = unplaced[bestSlot];
+			unplaced[bestSlot] = unplaced[left - 1];
+			sprayMasks[m][best] = (uint8_t)(rank * 256 / n);
+
+			// only cells closer to the new point than the largest remaining distance can change
+			if ((rank & 63) == 0)
+			{
+				int maxDist2 = 0;
+				for (int i = 0; i < n; i++)
+					if (dist2[i] > maxDist2)
+						maxDist2 = dist2[i];
+				reach = (int)ceilf(sqrtf((float)maxDist2));
+				if (reach > SPRAY_MASK_SIZE / 2)
+					reach = SPRAY_MASK_SIZE / 2;
+			}
+			int bx = best & (SPRAY_MASK_SIZE - 1), by = best >> SPRAY_MASK_BITS;
+			for (int dy = -reach; dy < reach; dy++)
+			{
+				for (int dx = -reach; dx < reach; dx++)
+				{
+					int i = (((by + dy) & (SPRAY_MASK_SIZE - 1)) << SPRAY_MASK_BITS) | ((bx + dx) & (SPRAY_MASK_SIZE - 1));
+					int d2 = dx * dx + dy * dy;
+					if (d2 < dist2[i])
+						dist2[i] = d2;
+				}
+			}
+		}
+	}
+	free(unplaced);
+	free(dist2);
+	sprayMasksReady = 1;
+}
+static const uint8_t *sprayMaskNext()
+{
+	if (!sprayMasksReady)
+		sprayMasksInit();
+	sprayMaskIndex = (sprayMaskIndex + 1) % SPRAY_MASK_COUNT;
+	return sprayMasks[sprayMaskIndex];
+}
+
+// x range [*x0, *x1] of row y that lies within distance reach of the segment (ax, ay)-(bx, by)
+static int capsuleRow(float ax, float ay, float bx, float by, float reach, float y, float *x0, float *x1)
+{
+	float l = INFINITY, r = -INFINITY;
+
+	// end caps
+	float ey = y - ay;
+	if (fabsf(ey) <= reach)
+	{
+		float w = sqrtf(reach * reach - ey * ey);
+		l = fminf(l, ax - w); r = fmaxf(r, ax + w);
+	}
+	ey = y - by;
+	if (fabsf(ey) <= reach)
+	{
+		float w = sqrtf(reach * reach - ey * ey);
+		l = fminf(l, bx - w); r = fmaxf(r, bx + w);
+	}
+
+	// body: 0 <= projection <= len2 and |cross| <= reach * len
+	float dx = bx - ax, dy = by - ay, len2 = dx * dx + dy * dy;
+	if (len2 > 0.0f)
+	{
+		float bl = -INFINITY, br = INFINITY;
+		ey = y - ay;
+		float proj = ey * dy, cross = -ey * dx, limit = reach * sqrtf(len2);
+		if (dx != 0.0f)
+		{
+			float t0 = ax - proj / dx, t1 = ax + (len2 - proj) / dx;
+			bl = fmaxf(bl, fminf(t0, t1)); br = fminf(br, fmaxf(t0, t1));
+		}
+		else if (proj < 0.0f || proj > len2)
+			br = -INFINITY;
+		if (dy != 0.0f)
+		{
+			float t0 = ax + (-limit - cross) / dy, t1 = ax + (limit - cross) / dy;
+			bl = fmaxf(bl, fminf(t0, t1)); br = fminf(br, fmaxf(t0, t1));
+		}
+		else if (fabsf(cross) > limit)
+			br = -INFINITY;
+		if (bl <= br)
+		{
+			l = fminf(l, bl); r = fmaxf(r, br);
+		}
+	}
+
+	*x0 = l; *x1 = r;
+	return l <= r;
+}
+
+// Worker pool: poolRun() hands the same job to every worker, the calling thread being worker 0,
+// and returns once all of them are done.
+#define MAX_WORKERS 64
+static int workerCount = 1;
+static struct
+{
+	pthread_mutex_t mutex;
+	pthread_cond_t start, done;
+	void (*job)(int worker);
+	unsigned generation;
+	int pending;
+} pool = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, 0, 0 };
+static void *poolWorker(void *arg)
+{
+	int worker = (int)(intptr_t)arg;
+	unsigned generation = 0;
+	for (;;)
+	{
+		pthread_mutex_lock(&pool.mutex);
+		while (pool.generation == generation)
+			pthread_cond_wait(&pool.start, &pool.mutex);
+		generation = pool.generation;
+		void (*job)(int worker) = pool.job;
+		pthread_mutex_unlock(&pool.mutex);
+
+		job(worker);
+
+		pthread_mutex_lock(&pool.mutex);
+		if (--pool.pending == 0)
+			pthread_cond_signal(&pool.done);
+		pthread_mutex_unlock(&pool.mutex);
+	}
+	return NULL;
+}
+static void poolInit(int workers)
+{
+	workerCount = workers < 1 ? 1 : (workers > MAX_WORKERS ? MAX_WORKERS : workers);
+	for (int i = 1; i < workerCount; i++)
+	{
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, poolWorker, (void*)(intptr_t)i))
+		{
+			workerCount = i;
+			break;
+		}
+		pthread_detach(thread);
+	}
+	printf("Using %d worker thread%s.\n", workerCount, workerCount > 1 ? "s" : "");
+}
+static void poolRun(void (*job)(int worker))
+{
+	pthread_mutex_lock(&pool.mutex);
+	pool.job = job;
+	pool.pending = workerCount - 1;
+	pool.generation++;
+	pthread_cond_broadcast(&pool.start);
+	pthread_mutex_unlock(&pool.mutex);
+
+	job(0);
+
+	pthread_mutex_lock(&pool.mutex);
+	while (pool.pending > 0)
+		pthread_cond_wait(&pool.done, &pool.mutex);
+	pthread_mutex_unlock(&pool.mutex);
+}
+
+// Brush segments are queued during the frame and rasterized together by strokeFlush(). The canvas
+// is cut into bands of STROKE_TILE_ROWS rows and band i belongs to worker i % workerCount, so every
+// worker blends into its own rows of pixels and encodes into its own buffer without locking.
+#define STROKE_TILE_ROWS TILE_H
+#define MAX_SEGMENTS 256
+typedef struct
+{
+	int x0, y0, x1, y1;
+	int skipStart;
+	int speculative; // predicted, sent without touching the local canvas
+	brush_t brush; // copied, the brush may be edited before the segment is drawn
+	const uint8_t *mask;
+	uint64_t serial;
+	int minAlpha; // fainter pixels are left to the refinement pass
+} segment_t;
+static segment_t segments[MAX_SEGMENTS];
+static int segmentCount = 0;
+static uint64_t segmentSerial = 0;
+static outbuf_t strokeBuffers[MAX_WORKERS];
+
+// Adaptive quality: while the interactive queue backs up, strokes leave out pixels fainter than
+// qualityCutoff. They are kept per band and drawn by the refinement job once the link recovers.
+#define MAX_REFINE (1 << 20)
+typedef struct
+{
+	pixel_t *data; // colors with the pixel's alpha
+	int start, count, capacity;
+} refine_list_t;
+static refine_list_t refineLists[MAX_WORKERS], refine;
+static int qualityCutoff = 0;
+static int congestionKiB = 64;
+
+static void refineAppend(refine_list_t *list, const pixel_t *items, int n)
+{
+	if (list->start)
+	{
+		memmove(list->data, list->data + list->start, (list->count - list->start) * sizeof(pixel_t));
+		list->count -= list->start;
+		list->start = 0;
+	}
+	if (list->count + n > MAX_REFINE)
+		n = MAX_REFINE - list->count; // too far behind, the faintest details are lost
+	if (n <= 0)
+		return;
+	if (list->count + n > list->capacity)
+	{
+		list->capacity = list->capacity ? list->capacity : 4096;
+		while (list->count + n > list->capacity)
+			list->capacity *= 2;
+		list->data = realloc(list->data, list->capacity * sizeof(pixel_t));
+	}
+	memcpy(list->data + list->count, items, n * sizeof(pixel_t));
+	list->count += n;
+}
+
+// Rasterizes the round brush swept from (x0, y0) to (x1, y1) analytically: every pixel within
+// reach of the segment is touched exactly once with the falloff of its distance to the segment.
+// If skipStart is set the start cap is left out, since the previous segment already painted it.
+// Only the rows of the given tile band are drawn; random spray is seeded per row, so the result
+// does not depend on how the rows are distributed.
+static void brushSegment(const segment_t *segment, int band, int bands)
+{
+	const brush_t *brush = &segment->brush;
+	int x0 = segment->x0, y0 = segment->y0, x1 = segment->x1, y1 = segment->y1;
+	float radius = brush->size / 2.0f;
+	float shape = brush->shape / 10.0f;
+	float a2 = powf(brush->color.a / 255.0f, 1.0f / 5.0f);
+
+	// alpha = 255 * (a2 * (1 - d / radius * shape))^7 drops below 1 at this distance
+	float cutoff = powf(1.0f / 255.0f, 1.0f / 7.0f);
+	if (a2 < cutoff)
+		return;
+	float reach = radius;
+	if (shape > 0.0f)
+		reach = fminf(reach, radius / shape * (1.0f - cutoff / a2));
+
+	float dx = (float)(x1 - x0), dy = (float)(y1 - y0);
+	float len2 = dx * dx + dy * dy;
+	float reach2 = reach * reach;
+	const uint8_t *mask = segment->mask;
+
+	int ymin = (int)floorf((y0 < y1 ? y0 : y1) - reach), ymax = (int)ceilf((y0 > y1 ? y0 : y1) + reach);
+	if (ymin < 0) ymin = 0;
+	if (ymax > pixelsHeight - 1) ymax = pixelsHeight - 1;
+	for (int y = ymin; y <= ymax; y++)
+	{
+		if ((y / STROKE_TILE_ROWS) % bands != band)
+		{
+			y = (y / STROKE_TILE_ROWS + 1) * STROKE_TILE_ROWS - 1; // skip to the next band
+			continue;
+		}
+
+		float fl, fr;
+		if (!capsuleRow(x0, y0, x1, y1, reach, y, &fl, &fr))
+			continue;
+		int xl = (int)ceilf(fl), xr = (int)floorf(fr);
+		if (xl < 0) xl = 0;
+		if (xr > pixelsWidth - 1) xr = pixelsWidth - 1;
+		if (xl > xr)
+			continue;
+
+		if (!mask && brush->spray > 1)
+			rngSeed(&rng, rngSeedValue ^ segment->serial, y);
+		uint8_t alphas[xr - xl + 1];
+		memset(alphas, 0, sizeof(alphas));
+		float py = (float)(y - y0);
+		for (int x = xl; x <= xr; x++)
+		{
+			float px = (float)(x - x0);
+			if (segment->skipStart && px * px + py * py <= reach2)
+				continue;
+			if (mask)
+			{
+				int m = (((y - y0) & (SPRAY_MASK_SIZE - 1)) << SPRAY_MASK_BITS) | ((x - x0) & (SPRAY_MASK_SIZE - 1));
+				if (mask[m] * brush->spray >= 256)
+					continue;
+			}
+			else if (brush->spray > 1 && (rngNext(&rng) % 100) % brush->spray != 0)
+				continue;
+
+			// distance to the segment
+			float t = len2 > 0.0f ? (px * dx + py * dy) / len2 : 0.0f;
+			t = t < 0.0f ? 0.0f : (t > 1.0f ? 1.0f : t);
+			float ex = px - t * dx, ey = py - t * dy;
+			float alpha = a2 * (1.0f - sqrtf(ex * ex + ey * ey) / radius * shape);
+			if (alpha > 0.0f)
+			{
+				float alpha2 = alpha * alpha;
+				alpha = alpha2 * alpha2 * alpha2 * alpha * 255.0f;
+				if (alpha >= segment->minAlpha)
+					alphas[x - xl] = (uint8_t)alpha;
+				else if (alpha >= 1.0f && !segment->speculative)
+				{
+					pixel_t skipped = { x, y, brush->color };
+					skipped.color.a = (uint8_t)alpha;
+					refineAppend(&refineLists[band], &skipped, 1);
+					refineMarks[y * pixelsWidth + x] = 1;
+				}
+			}
+		}
+		if (segment->speculative)
+			speculateSpan(xl, y, xr - xl + 1, brush->color, alphas);
+		else
+			setSpanAlphas(xl, y, xr - xl + 1, brush->color, alphas);
+	}
+}
+
+static void strokeJob(int worker)
+{
+	outbuf_t *previous = out;
+	if (workerCount > 1)
+		out = &strokeBuffers[worker];
+	for (int i = 0; i < segmentCount; i++)
+		brushSegment(&segments[i], worker, workerCount);
+	out = previous;
+}
+
+// draws all queued segments; the workers' commands are sent in worker order
+static void strokeFlush()
+{
+	if (!segmentCount)
+		return;
+	if (workerCount > 1)
+	{
+		poolRun(strokeJob);
+		outSubmit(&sendBuffer);
+		for (int i = 0; i < workerCount; i++)
+		{
+			lanePush(LANE_INTERACTIVE, strokeBuffers[i].data, strokeBuffers[i].p - strokeBuffers[i].data);
+			strokeBuffers[i].p = strokeBuffers[i].data;
+		}
+	}
+	else
+	{
+		strokeJob(0);
+		outSubmit(&sendBuffer);
+	}
+	for (int i = 0; i < workerCount; i++)
+	{
+		refineAppend(&refine, refineLists[i].data, refineLists[i].count);
+		refineLists[i].count = 0;
+	}
+	segmentCount = 0;
+}
+
+// bytes waiting for the link ahead of a new stroke
+static size_t interactiveBacklog()
+{
+	int queued, unsent;
+	socketQueue(sockfd, &queued, &unsent);
+	return laneQueued(LANE_INTERACTIVE) + laneQueued(LANE_PREDICTION) + unsent;
+}
+
+// once per frame: the cut-off rises from 0 at congestionKiB of backlog to 128 at four times that
+static void qualityUpdate()
+{
+	size_t threshold = (size_t)congestionKiB * 1024, backlog = interactiveBacklog();
+	qualityCutoff = backlog <= threshold ? 0 : (int)((backlog - threshold) * 128 / (3 * threshold));
+	if (qualityCutoff > 128)
+		qualityCutoff = 128;
+	refineMarking = qualityCutoff || refine.count;
+}
+
+// Refinement shares the interactive lane, so it stays ordered with strokes and prediction
+// corrections on the same pixels, but only runs while that lane is nearly empty.
+static int refineStep()
+{
+	if (refine.start == refine.count || qualityCutoff ||
+		interactiveBacklog() > (size_t)congestionKiB * 1024 / 2)
+		return 0;
+	int end = refine.start + 256 < refine.count ? refine.start + 256 : refine.count;
+	pixel_t batch[256];
+	int count = 0;
+	for (; refine.start < end; refine.start++)
+	{
+		const pixel_t *r = &refine.data[refine.start];
+		if (refineMarks[r->y * pixelsWidth + r->x]) // otherwise painted over since
+			batch[count++] = *r;
+	}
+	setPixels(batch, count);
+	outSubmit(&sendBuffer);
+	if (refine.start == refine.count)
+	{
+		refine.start = refine.count = 0;
+		refineMarking = qualityCutoff != 0;
+		if (!refineMarking)
+			memset(refineMarks, 0, pixelsWidth * pixelsHeight);
+	}
+	return 1;
+}
+
+// The reader thread keeps a copy of the server's canvas from the answers to readback requests.
+// Answers come in the order of the requests, so a request is answered once readbackAnswered
+// reaches the count readbackRequest() returned for it.
+static uint8_t *remote;
+static uint64_t readbackAnswered = 0, readbackRequested = 0;
+static pthread_mutex_t readbackMutex = PTHREAD_MUTEX_INITIALIZER;
+
+// queues count pixel requests into the normal lane
+static uint64_t readbackRequest(const unsigned char *data, size_t len, int count)
+{
+	pthread_mutex_lock(&readbackMutex);
+	lanePush(LANE_NORMAL, data, len);
+	uint64_t end = readbackRequested += count;
+	pthread_mutex_unlock(&readbackMutex);
+	return end;
+}
+
+// answers were lost on a reconnect, counts afresh from the ones that came
+static void readbackReset(uint64_t answered)
+{
+	pthread_mutex_lock(&readbackMutex);
+	if (__atomic_load_n(&readbackAnswered, __ATOMIC_ACQUIRE) == answered)
+		readbackRequested = answered;
+	pthread_mutex_unlock(&readbackMutex);
+}
+
+static void *readbackThread(void *arg)
+{
+	char buffer[4096];
+	int length = 0, fd = -1;
+	unsigned connection = 0;
+	for (;;)
+	{
+		// the sender replaces sockfd when it reconnects, read from a duplicate of the current one
+		if (connection != __atomic_load_n(&connections, __ATOMIC_ACQUIRE))
+		{
+			pthread_mutex_lock(&connectMutex);
+			if (fd >= 0)
+				close(fd);
+			fd = dup(sockfd);
+			connection = connections;
+			pthread_mutex_unlock(&connectMutex);
+			length = 0;
+		}
+		if (poll(&(struct pollfd){ fd, POLLIN, 0 }, 1, 100) <= 0)
+			continue;
+		int n = read(fd, buffer + length, sizeof(buffer) - length);
+		if (n <= 0)
+		{
+			if (n == 0)
+				usleep(100000);
+			continue;
+		}
+		length += n;
+		char *line = buffer, *end;
+		while ((end = memchr(line, '\n', buffer + length - line)))
+		{
+			*end = '\0';
+			int x, y;
+			char color[16];
+			if (sscanf(line, "PX %d %d %15s", &x, &y, color) == 3 &&
+				x >= 0 && y >= 0 && x < pixelsWidth && y < pixelsHeight)
+			{
+				uint32_t rgb = (uint32_t)strtoul(color, NULL, 16);
+				if (strlen(color) == 8)
+					rgb >>= 8; // rrggbbaa
+				uint8_t *p = remote + (y * pixelsWidth + x) * 3;
+				p[0] = rgb >> 16; p[1] = rgb >> 8; p[2] = rgb;
+				__atomic_add_fetch(&readbackAnswered, 1, __ATOMIC_RELEASE);
+			}
+			line = end + 1;
+		}
+		length -= (int)(line - buffer);
+		memmove(buffer, line, length);
+		if (length == sizeof(buffer))
+			length = 0; // garbage
+	}
+	return NULL;
+}
+
+// Defense mode: our tiles are read back one after another and the pixels somebody else painted
+// over are sent again. Tiles that were damaged before are checked more often, and a token bucket
+// limits readback requests and repairs to defense.kiBps.
+#define DEFENSE_IN_FLIGHT 8
+static struct
+{
+	int enabled, kiBps;
+	double tokens, lastTime;
+	uint64_t repaired;
+	struct { int tile; uint64_t end; uint32_t frame; double time; } flight[DEFENSE_IN_FLIGHT];
+	int flightStart, flightCount;
+} defense = { 0, 256, 0, 0, 0, { { 0 } }, 0, 0 };
+static outbuf_t defenseBuffer = { NULL, NULL, 0, 1, LANE_NORMAL };
+
+// queues our color for every pixel of the tile that differs on the server, returns their number
+static int defenseRepair(chunk_t **c, int t)
+{
+	int x0 = (t % tilesX) * TILE_W, y0 = (t / tilesX) * TILE_H;
+	int w = pixelsWidth - x0 < TILE_W ? pixelsWidth - x0 : TILE_W;
+	int h = pixelsHeight - y0 < TILE_H ? pixelsHeight - y0 : TILE_H;
+	int damaged = 0;
+	for (int y = y0; y < y0 + h; y++)
+	{
+		size_t row = (size_t)y * pixelsWidth + x0;
+		const uint8_t *want = pixels + row * 3, *have = remote + row * 3, *mine = owned + row;
+		for (int j = 0; j < w; j++)
+			if (mine[j])
+				sentSet(row + j, have[j * 3], have[j * 3 + 1], have[j * 3 + 2]); // read back, so known
+		int i = firstDifference(want, have, w * 3) / 3;
+		while (i < w)
+		{
+			int start = i;
+			for (; i < w && mine[i] && memcmp(want + i * 3, have + i * 3, 3); i++)
+			{
+				int first = i;
+				for (; i + 1 < w && mine[i + 1] && !memcmp(want + i * 3 + 3, want + first * 3, 3) &&
+					memcmp(want + i * 3 + 3, have + i * 3 + 3, 3); i++);
+				chunkRun(c, x0 + first, y, i - first + 1, nk_rgba(want[first * 3], want[first * 3 + 1], want[first * 3 + 2], 255));
+			}
+			if (i > start)
+			{
+				if (!damaged)
+				{
+					// somebody else paints here, nothing we sent to this tile can be trusted any more
+					for (int ty = y0; ty < y0 + h; ty++)
+						memset(sentEpoch + (size_t)ty * pixelsWidth + x0, 0, w);
+				}
+				if (!tilesMixed(x0 + start, y, i - start, (*c)->lane))
+					for (int j = start; j < i; j++)
+						sentSet(row + j, want[j * 3], want[j * 3 + 1], want[j * 3 + 2]);
+				damaged += i - start;
+			}
+			else
+				i++;
+			if (i < w)
+				i += firstDifference(want + i * 3, have + i * 3, (w - i) * 3) / 3;
+		}
+	}
+	// readback requests skip the encoders, hold the next one until the repair has been sent
+	if (damaged)
+		tiles[t].lanes[(*c)->lane] = frameNumber;
+	return damaged;
+}
+
+// asks the server for every pixel of the tile we own, returns how many
+static int defenseRequest(int t)
+{
+	int x0 = (t % tilesX) * TILE_W, y0 = (t / tilesX) * TILE_H;
+	int w = pixelsWidth - x0 < TILE_W ? pixelsWidth - x0 : TILE_W;
+	int h = pixelsHeight - y0 < TILE_H ? pixelsHeight - y0 : TILE_H;
+	int count = 0;
+	for (int y = y0; y < y0 + h; y++)
+	{
+		const uint8_t *mine = owned + (size_t)y * pixelsWidth + x0;
+		for (int x = 0; x < w; x++)
+		{
+			if (!mine[x])
+				continue;
+			outReserve(&defenseBuffer, MAX_PIXEL_COMMAND);
+			unsigned char *q = defenseBuffer.p;
+			memcpy(q, "PX ", 3); q += 3;
+			memcpy(q, coordText[x0 + x], 8); q += coordText[x0 + x][7]; *q++ = ' ';
+			memcpy(q, coordText[y], 8); q += coordText[y][7]; *q++ = '\n';
+			defenseBuffer.p = q;
+			count++;
+		}
+	}
+	return count;
+}
+
+static int defenseStep()
+{
+	if (!defense.enabled)
+		return 0;
+	int worked = 0;
+	double now = monotonicTime();
+	defense.tokens += (now - defense.lastTime) * defense.kiBps * 1024.0;
+	defense.lastTime = now;
+	if (defense.tokens > 64 * 1024)
+		defense.tokens = 64 * 1024;
+
+	uint64_t answered = __atomic_load_n(&readbackAnswered, __ATOMIC_ACQUIRE);
+	while (defense.flightCount)
+	{
+		int f = defense.flightStart;
+		tile_t *tile = &tiles[defense.flight[f].tile];
+		if (answered < defense.flight[f].end)
+		{
+			if (now - defense.flight[f].time < 5.0)
+				break;
+			// answers were lost on a reconnect, start counting afresh
+			for (int i = 0; i < defense.flightCount; i++)
+				tiles[defense.flight[(f + i) % DEFENSE_IN_FLIGHT].tile].pending = 0;
+			defense.flightCount = 0;
+			readbackReset(answered);
+			break;
+		}
+		if (!chunksWanted(LANE_NORMAL))
+			break;
+		if (tile->drawn < defense.flight[f].frame) // otherwise our own drawing may still be on its way
+		{
+			chunk_t *chunk = chunkNew(LANE_NORMAL);
+			int damaged = defenseRepair(&chunk, defense.flight[f].tile);
+			defense.tokens -= chunk->pixels * 20.0; // about what a pixel takes encoded
+			chunkSubmit(chunk);
+			tile->heat = tile->heat * 0.5f + damaged;
+			defense.repaired += damaged;
+		}
+		tile->pending = 0;
+		tile->checked = frameNumber;
+		defense.flightStart = (f + 1) % DEFENSE_IN_FLIGHT;
+		defense.flightCount--;
+		worked = 1;
+	}
+
+	// readback only starts once our strokes are on the wire ahead of it
+	if (defense.flightCount == DEFENSE_IN_FLIGHT || defense.tokens <= 0 ||
+		laneQueued(LANE_INTERACTIVE) || laneQueued(LANE_PREDICTION))
+		return worked;
+	int best = -1;
+	float bestPriority = 0.0f;
+	for (int t = 0; t < tilesX * ((pixelsHeight + TILE_H - 1) / TILE_H); t++)
+	{
+		const tile_t *tile = &tiles[t];
+		if (!tile->owned || tile->pending || !tileSettled(tile))
+			continue;
+		float priority = (frameNumber - tile->checked) * (1.0f + tile->heat);
+		if (best < 0 || priority > bestPriority)
+			best = t, bestPriority = priority;
+	}
+	if (best < 0)
+		return worked;
+	int count = defenseRequest(best);
+	if (!count)
+	{
+		tiles[best].owned = 0;
+		return 1;
+	}
+	defense.tokens -= defenseBuffer.p - defenseBuffer.data;
+	int f = (defense.flightStart + defense.flightCount++) % DEFENSE_IN_FLIGHT;
+	defense.flight[f].tile = best;
+	defense.flight[f].end = readbackRequest(defenseBuffer.data, defenseBuffer.p - defenseBuffer.data, count);
+	defenseBuffer.p = defenseBuffer.data;
+	defense.flight[f].frame = frameNumber;
+	defense.flight[f].time = now;
+	tiles[best].pending = 1;
+	return 1;
+}
+
+static void defenseInit()
+{
+	tilesX = (pixelsWidth + TILE_W - 1) / TILE_W;
+	tiles = calloc(tilesX * ((pixelsHeight + TILE_H - 1) / TILE_H), sizeof(tile_t));
+	owned = calloc(pixelsWidth * pixelsHeight, 1);
+	remote = calloc(pixelsWidth * pixelsHeight * 3, 1);
+	defense.lastTime = monotonicTime();
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, readbackThread, NULL))
+	{
+		fprintf(stderr, "ERROR creating the readback thread\n");
+		exit(1);
+	}
+	pthread_detach(thread);
+}
+
+// UDP transport (-u port) for servers that also take binary pixels over UDP: the bulk lane then
+// holds records, which the UDP sender packs into datagrams as large as the path MTU allows and
+// hands to the kernel in batches with sendmmsg(). It paces itself, and samples of what it sent are
+// read back over TCP: the rate backs off while they show losses and creeps up to udp.kiBps while
+// they do not.
+#define UDP_BATCH 32 // datagrams per sendmmsg()
+#define UDP_SAMPLES 64
+#define UDP_SAMPLE_DELAY 0.05 // seconds for a datagram to be processed before its sample is asked for
+#define UDP_WINDOW 16 // samples per rate decision
+static struct
+{
+	int fd, port;
+	size_t payload; // bytes of records per datagram
+	int kiBps; // rate limit, set by the UI
+	double rate; // bytes per second
+	uint64_t datagrams, checked, lost; // written by the UDP thread, read atomically by the UI
+	double loss; // in the last window
+	struct { uint16_t x, y; uint8_t rgb[3]; uint64_t end; double time; } samples[UDP_SAMPLES];
+	int sampleStart, sampleCount, sampleAsked;
+} udp = { -1, 0, 1472, 64 * 1024, 1024 * 1024, 0, 0, 0, 0, { { 0 } }, 0, 0, 0 };
+
+static void udpConnect()
+{
+	struct hostent *server = gethostbyname(hostname);
+	if (server == NULL)
+	{
+		perror("ERROR no such host\n");
+		exit(1);
+	}
+	struct sockaddr_in serv_addr;
+	bzero((char *) &serv_addr, sizeof(serv_addr));
+	serv_addr.sin_family = AF_INET;
+	bcopy(server->h_addr_list[0], (char *)&serv_addr.sin_addr.s_addr, server->h_length);
+	serv_addr.sin_port = htons(udp.port);
+	udp.fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (udp.fd < 0 || connect(udp.fd, (struct sockaddr*)&serv_addr, sizeof(serv_addr)) < 0)
+	{
+		perror("ERROR opening the UDP socket\n");
+		exit(2);
+	}
+	#ifdef IP_MTU
+	int mtu;
+	socklen_t size = sizeof(mtu);
+	if (!getsockopt(udp.fd, IPPROTO_IP, IP_MTU, &mtu, &size) && mtu > 28 + UDP_RECORD)
+		udp.payload = mtu - 28 < 65507 ? mtu - 28 : 65507; // without the IP and UDP headers
+	#endif
+	udp.payload -= udp.payload % UDP_RECORD;
+	setsockopt(udp.fd, SOL_SOCKET, SO_SNDBUF, &(int){ 4 * 1024 * 1024 }, sizeof(int));
+	fcntl(udp.fd, F_SETFL, fcntl(udp.fd, F_GETFL, 0) | O_NONBLOCK);
+	lanes[LANE_BULK].record = UDP_RECORD;
+	printf("Sending bulk pixels over UDP port %d, %zu per datagram.\n", udp.port, udp.payload / UDP_RECORD);
+}
+
+// asks for the samples that had time to arrive and checks the answered ones
+static void udpSamples(double now, int *checked, int *lost)
+{
+	while (udp.sampleAsked < udp.sampleCount)
+	{
+		int i = (udp.sampleStart + udp.sampleAsked) % UDP_SAMPLES;
+		if (now - udp.samples[i].time < UDP_SAMPLE_DELAY)
+			break;
+		unsigned char request[32];
+		int length = sprintf((char*)request, "PX %d %d\n", udp.samples[i].x, udp.samples[i].y);
+		udp.samples[i].end = readbackRequest(request, length, 1);
+		udp.samples[i].time = now;
+		udp.sampleAsked++;
+	}
+	uint64_t answered = __atomic_load_n(&readbackAnswered, __ATOMIC_ACQUIRE);
+	while (udp.sampleAsked)
+	{
+		int i = udp.sampleStart;
+		if (answered >= udp.samples[i].end)
+		{
+			size_t p = (size_t)udp.samples[i].y * pixelsWidth + udp.samples[i].x;
+			int missing = memcmp(remote + p * 3, udp.samples[i].rgb, 3) != 0;
+			(*checked)++;
+			*lost += missing;
+			__atomic_add_fetch(&udp.checked, 1, __ATOMIC_RELAXED);
+			__atomic_add_fetch(&udp.lost, missing, __ATOMIC_RELAXED);
+		}
+		else if (now - udp.samples[i].time < 2.0)
+			break; // otherwise the answer was lost on a reconnect
+		udp.sampleStart = (i + 1) % UDP_SAMPLES;
+		udp.sampleCount--;
+		udp.sampleAsked--;
+	}
+}
+
+// hands the datagrams to the kernel, in a single call where there is sendmmsg(), returns how many it took
+static int udpSend(struct iovec *iovs, int count)
+{
+	#ifdef __linux__
+	struct mmsghdr messages[UDP_BATCH];
+	memset(messages, 0, count * sizeof(*messages));
+	for (int i = 0; i < count; i++)
+	{
+		messages[i].msg_hdr.msg_iov = &iovs[i];
+		messages[i].msg_hdr.msg_iovlen = 1;
+	}
+	return sendmmsg(udp.fd, messages, count, 0);
+	#else
+	int sent = 0;
+	while (sent < count && send(udp.fd, iovs[sent].iov_base, iovs[sent].iov_len, 0) >= 0)
+		sent++;
+	return sent ? sent : -1;
+	#endif
+}
+
+static void *udpThread(void *arg)
+{
+	unsigned char *data = malloc(UDP_BATCH * udp.payload);
+	struct iovec iovs[UDP_BATCH];
+	for (int i = 0; i < UDP_BATCH; i++)
+		iovs[i].iov_base = data + i * udp.payload;
+	double credit = 0, last = monotonicTime();
+	int checked = 0, lost = 0;
+	rngSeed(&rng, rngSeedValue, 0x0d9);
+	for (;;)
+	{
+		double now = monotonicTime();
+		udpSamples(now, &checked, &lost);
+		if (checked >= UDP_WINDOW)
+		{
+			double limit = __atomic_load_n(&udp.kiBps, __ATOMIC_RELAXED) * 1024.0;
+			double loss = (double)lost / checked, rate = lost ? udp.rate * 0.5 : udp.rate * 1.1;
+			rate = rate < 64 * 1024 ? 64 * 1024 : (rate > limit ? limit : rate);
+			__atomic_store(&udp.loss, &loss, __ATOMIC_RELAXED);
+			__atomic_store(&udp.rate, &rate, __ATOMIC_RELAXED);
+			checked = lost = 0;
+		}
+
+		pthread_mutex_lock(&sender.mutex);
+		unsigned signals = sender.signals;
+		pthread_mutex_unlock(&sender.mutex);
+		// batches of about 10 ms worth, so the pace holds for the server's receive buffer
+		size_t burst = udp.rate * 0.01 > udp.payload ? udp.rate * 0.01 : udp.payload;
+		int count = 0;
+		size_t bytes = 0;
+		for (; count < UDP_BATCH && bytes + udp.payload <= burst; count++)
+		{
+			iovs[count].iov_len = laneTake(LANE_BULK, iovs[count].iov_base, udp.payload);
+			if (!iovs[count].iov_len)
+				break;
+			bytes += iovs[count].iov_len;
+		}
+		if (!count)
+		{
+			senderWait(signals, udp.sampleCount ? UDP_SAMPLE_DELAY : 1.0);
+			continue;
+		}
+
+		credit += (now - last) * udp.rate;
+		last = now;
+		if (credit > burst)
+			credit = burst;
+		if (credit < bytes)
+			usleep((useconds_t)((bytes - credit) / udp.rate * 1e6));
+		credit -= bytes;
+
+		for (int sent = 0; sent < count;)
+		{
+			int n = udpSend(iovs + sent, count - sent);
+			if (n > 0)
+				sent += n;
+			else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS))
+				poll(&(struct pollfd){ udp.fd, POLLOUT, 0 }, 1, 100);
+			else if (n < 0 && errno == ECONNREFUSED)
+				continue; // an earlier datagram found no listener, this one may
+			else if (n < 0 && errno != EINTR)
+			{
+				fprintf(stderr, "ERROR %d sending datagrams\n", errno);
+				exit(1);
+			}
+		}
+		__atomic_add_fetch(&udp.datagrams, count, __ATOMIC_RELAXED);
+		now = monotonicTime();
+
+		// a random record of each datagram is checked while there is room for it, if it is opaque
+		for (int i = 0; i < count && udp.sampleCount < UDP_SAMPLES; i++)
+		{
+			const unsigned char *r = (unsigned char*)iovs[i].iov_base + rngNext(&rng) % (iovs[i].iov_len / UDP_RECORD) * UDP_RECORD;
+			if (r[7] != 255)
+				continue;
+			int s = (udp.sampleStart + udp.sampleCount++) % UDP_SAMPLES;
+			udp.samples[s].x = r[0] | r[1] << 8;
+			udp.samples[s].y = r[2] | r[3] << 8;
+			memcpy(udp.samples[s].rgb, r + 4, 3);
+			udp.samples[s].time = now;
+		}
+	}
+	return NULL;
+}
+
+static void udpStart()
+{
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, udpThread, NULL))
 	{
-		perror("ERROR no such host\n");
+		fprintf(stderr, "ERROR creating the UDP sender thread\n");
 		exit(1);
 	}
-	struct sockaddr_in serv_addr;
-	bzero((char *) &serv_addr, sizeof(serv_addr));
-	serv_addr.sin_family = AF_INET;
-	bcopy(server->h_addr_list[0], (char *)&serv_addr.sin_addr.s_addr, server->h_length);
-	serv_addr.sin_port = htons(port);
+	pthread_detach(thread);
+}
 
-	sockfd = socket(AF_INET, SOCK_STREAM, 0);
-	if (sockfd < 0)
+static void strokeSegment(int x0, int y0, int x1, int y1, brush_t *brush, int skipStart)
+{
+	if (segmentCount == MAX_SEGMENTS)
+		strokeFlush();
+	segment_t *segment = &segments[segmentCount++];
+	segment->x0 = x0; segment->y0 = y0; segment->x1 = x1; segment->y1 = y1;
+	segment->skipStart = skipStart;
+	segment->speculative = 0;
+	segment->brush = *brush;
+	segment->mask = brush->spray > 1 && brush->sprayMask ? sprayMaskNext() : NULL;
+	segment->serial = segmentSerial++;
+	segment->minAlpha = qualityCutoff > 1 ? qualityCutoff : 1;
+}
+
+static void brushPoint(int x, int y, brush_t *brush)
+{
+	strokeSegment(x, y, x, y, brush, 0);
+}
+
+static void brushLine(struct nk_vec2 p0, struct nk_vec2 p1, brush_t *brush)
+{
+	strokeSegment((int)roundf(p0.x), (int)roundf(p0.y), (int)roundf(p1.x), (int)roundf(p1.y), brush, 1);
+}
+
+// Stroke tip prediction: the stabilized path is extrapolated predictionMs ahead from its recent
+// velocity and acceleration and the tip is queued speculatively in the prediction lane. Next frame
+// the unsent rest of the guess is discarded before the real stroke is queued, so no guess can
+// arrive after real pixels. Then every speculative pixel the real stroke did not cover opaquely
+// is overpainted with its local canvas color, so wrong guesses leave no trace.
+static int predictionMs = 0;
+static outbuf_t predictionBuffer = { NULL, NULL, 0, 1, LANE_PREDICTION };
+static void predictionCorrect()
+{
+	for (int i = 0; i < speculativeCount; i++)
 	{
-		perror("ERROR opening socket\n");
-		exit(2);
+		uint32_t index = speculativeList[i];
+		int covered = speculative[index] == 2;
+		speculative[index] = 0;
+		if (covered)
+			continue;
+		const uint8_t *pixel = pixels + index * 3;
+		int x = index % pixelsWidth, y = index / pixelsWidth;
+		encodeSpan(x, y, 1, nk_rgba(pixel[0], pixel[1], pixel[2], 255), NULL, NULL);
+		if (tilesMixed(x, y, 1, out->lane))
+			sentEpoch[index] = 0;
+		else
+			sentSet(index, pixel[0], pixel[1], pixel[2]);
+		tilesWritten(out->lane, x, y, 1);
 	}
+	speculativeCount = 0;
+	outSubmit(out);
+}
+static void predictionDraw(struct nk_vec2 from, struct nk_vec2 to, brush_t *brush)
+{
+	int x0 = (int)roundf(from.x), y0 = (int)roundf(from.y);
+	int x1 = (int)roundf(to.x), y1 = (int)roundf(to.y);
+	if (x0 == x1 && y0 == y1)
+		return;
+	segment_t segment = { x0, y0, x1, y1, 1, 1, *brush, NULL, segmentSerial++, qualityCutoff > 1 ? qualityCutoff : 1 };
+	outbuf_t *previous = out;
+	out = &predictionBuffer;
+	brushSegment(&segment, 0, 1);
+	out = previous;
+	outSubmit(&predictionBuffer);
+}
 
-	if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &(int){ 1 }, sizeof(int)) < 0)
+// Stabilizer: the input samples of a stroke go through the brush's smoothing filter, whose strength
+// is brush->stabilization. The moving average keeps a ring of the last samples with a running sum,
+// exponential smoothing lags like an average of the same length but starts right away, and the
+// One Euro filter (Casiez et al. 2012) smooths strongly at low speed and follows fast movements.
+#define MAX_STABILIZATION 32 // power of two
+#define PREDICT_HISTORY 32 // power of two
+#define PREDICT_WINDOW 0.008 // seconds, the least time a velocity is measured over
+#define PREDICT_MAX_PIXELS 48.0f
+static struct
+{
+	struct nk_vec2 positions[MAX_STABILIZATION]; // ring of the last raw samples
+	int head, count;
+	double sumx, sumy;
+	struct nk_vec2 filtered, speed; // exponential and One Euro state
+	double lastTime;
+	struct nk_vec2 points[3]; // last stabilized points for Catmull-Rom interpolation
+	int pointCount;
+	struct nk_vec2 lastAverage; // last drawn point
+	struct nk_vec2 history[PREDICT_HISTORY]; // ring of the last stabilized points, for prediction
+	double historyTime[PREDICT_HISTORY];
+	int historyHead, historyCount;
+	brush_t *brush; // NULL while no stroke is in progress
+	int smoothing;
+} stabilizer = { .lastAverage = { -1, -1 } };
+
+static void stabilizerLine(struct nk_vec2 p, brush_t *brush)
+{
+	if (stabilizer.lastAverage.x == -1 && stabilizer.lastAverage.y == -1)
 	{
-		perror("setsockopt(SO_REUSEPORT) failed\n");
-		exit(3);
+		stabilizer.lastAverage = p;
+		brushPoint((int)roundf(p.x), (int)roundf(p.y), brush);
 	}
-	
-	if (connect(sockfd,(struct sockaddr*)&serv_addr, sizeof(serv_addr)) < 0)
+	if ((int)roundf(p.x) != (int)roundf(stabilizer.lastAverage.x) ||
+		(int)roundf(p.y) != (int)roundf(stabilizer.lastAverage.y))
+		brushLine(stabilizer.lastAverage, p, brush);
+	stabilizer.lastAverage = p;
+}
+
+// draws the Catmull-Rom curve from p1 to p2 in pieces of about two pixels
+static void stabilizerCurve(struct nk_vec2 p0, struct nk_vec2 p1, struct nk_vec2 p2, struct nk_vec2 p3, brush_t *brush)
+{
+	float length = sqrtf((p2.x - p1.x) * (p2.x - p1.x) + (p2.y - p1.y) * (p2.y - p1.y));
+	int steps = (int)ceilf(length / 2.0f);
+	for (int i = 1; i <= steps; i++)
 	{
-		perror("ERROR connecting\n");
-		exit(4);
+		float t = (float)i / steps, t2 = t * t, t3 = t2 * t;
+		struct nk_vec2 q = nk_vec2(
+			0.5f * (2 * p1.x + (p2.x - p0.x) * t + (2 * p0.x - 5 * p1.x + 4 * p2.x - p3.x) * t2 + (3 * p1.x - p0.x - 3 * p2.x + p3.x) * t3),
+			0.5f * (2 * p1.y + (p2.y - p0.y) * t + (2 * p0.y - 5 * p1.y + 4 * p2.y - p3.y) * t2 + (3 * p1.y - p0.y - 3 * p2.y + p3.y) * t3));
+		stabilizerLine(q, brush);
 	}
-
-	fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL, 0) | O_NONBLOCK);
-	signal(SIGPIPE, SIG_IGN);
 }
 
-static int pixelsWidth = 640, pixelsHeight = 480;
-static uint8_t *pixels;
-static void readSize()
+// draws up to the stabilized point p; with interpolation the curve ends one point behind
+static void stabilizerEmit(struct nk_vec2 p, double time, brush_t *brush)
 {
-	// retrieve server screen resolution using the SIZE command
-	fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL, 0) & (~O_NONBLOCK)); // temporarily disable non-blocking mode
-	int n = write(sockfd, "SIZE\n", 5);
-	if (n == 5)
+	if (p.x < 0 || p.y < 0 || p.x > pixelsWidth - 1 || p.y > pixelsHeight - 1)
+		return;
+	const int mask = PREDICT_HISTORY - 1;
+	if (stabilizer.historyCount == 0 || time > stabilizer.historyTime[(stabilizer.historyHead - 1) & mask])
 	{
-		char result[256];
-		n = read(sockfd, result, 256);
-		if (n > 5 && !strncmp(result, "SIZE ", 5))
-		{
-			int w, h;
-			n = sscanf(result, "SIZE %d %d", &w, &h);
-			if (n == 2)
-			{
-				pixelsWidth = w;
-				pixelsHeight = h;
-				printf("Received screen size from server: %dx%d\n", pixelsWidth, pixelsHeight);
-			}
-			else
-				printf("Bad SIZE payload!\n");
-		}
-		else
-			printf("Bad SIZE response!\n");
+		stabilizer.historyHead = (stabilizer.historyHead + 1) & mask;
+		if (stabilizer.historyCount < PREDICT_HISTORY)
+			stabilizer.historyCount++;
 	}
-	else
-		printf("Could not send SIZE command!\n");
-	fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL, 0) | O_NONBLOCK); // reenable non-blocking mode
+	stabilizer.history[(stabilizer.historyHead - 1) & mask] = p;
+	stabilizer.historyTime[(stabilizer.historyHead - 1) & mask] = time;
+	if (!brush->interpolate)
+	{
+		stabilizerLine(p, brush);
+		return;
+	}
+
+	struct nk_vec2 *points = stabilizer.points;
+	if (stabilizer.pointCount == 0)
+	{
+		stabilizerLine(p, brush);
+		points[0] = points[1] = p; // the curve starts with a zero length tangent
+		stabilizer.pointCount = 2;
+		return;
+	}
+	if (stabilizer.pointCount == 3)
+	{
+		stabilizerCurve(points[0], points[1], points[2], p, brush);
+		points[0] = points[1];
+		points[1] = points[2];
+		stabilizer.pointCount = 2;
+	}
+	points[stabilizer.pointCount++] = p;
+}
+
+static void stabilizerReset()
+{
+	// finish the interpolated curve up to the last stabilized point
+	struct nk_vec2 *points = stabilizer.points;
+	if (stabilizer.pointCount == 3)
+		stabilizerCurve(points[0], points[1], points[2], points[2], stabilizer.brush);
+
+	stabilizer.pointCount = 0;
+	stabilizer.historyCount = 0;
+	stabilizer.lastAverage = nk_vec2(-1, -1);
+	stabilizer.brush = NULL;
+}
+
+// the newest history sample at least PREDICT_WINDOW older than sample i (0 is the newest), -1 if none
+static int stabilizerWindow(int i)
+{
+	const int mask = PREDICT_HISTORY - 1;
+	double t = stabilizer.historyTime[(stabilizer.historyHead - 1 - i) & mask];
+	for (int j = i + 1; j < stabilizer.historyCount; j++)
+		if (t - stabilizer.historyTime[(stabilizer.historyHead - 1 - j) & mask] >= PREDICT_WINDOW)
+			return j;
+	return -1;
 }
 
-static int idleCounter = 0;
-static void keepAlive()
+// where the stabilized path will be in ahead seconds, if the stroke is moving. Velocities are
+// measured over at least PREDICT_WINDOW, since input times within a frame are only estimates.
+static int stabilizerPredict(double now, double ahead, struct nk_vec2 *predicted)
 {
-	if (++idleCounter >= 60)
+	const int mask = PREDICT_HISTORY - 1, head = stabilizer.historyHead;
+	const struct nk_vec2 *p = stabilizer.history;
+	const double *t = stabilizer.historyTime;
+	int n0 = (head - 1) & mask, i = stabilizer.brush ? stabilizerWindow(0) : -1;
+	if (i < 0 || now - t[n0] > 0.1)
+		return 0;
+	int n1 = (head - 1 - i) & mask;
+	float dt = (float)(t[n0] - t[n1]);
+	struct nk_vec2 v = nk_vec2((p[n0].x - p[n1].x) / dt, (p[n0].y - p[n1].y) / dt), a = nk_vec2(0, 0);
+	int j = stabilizerWindow(i);
+	if (j >= 0)
+	{
+		int n2 = (head - 1 - j) & mask;
+		float dt1 = (float)(t[n1] - t[n2]);
+		struct nk_vec2 v1 = nk_vec2((p[n1].x - p[n2].x) / dt1, (p[n1].y - p[n2].y) / dt1);
+		float dtv = (dt + dt1) / 2.0f;
+		a = nk_vec2((v.x - v1.x) / dtv, (v.y - v1.y) / dtv);
+	}
+
+	// extrapolate from the newest point, but never more than 1.5 times the linear prediction and
+	// never further than PREDICT_MAX_PIXELS
+	float ta = (float)(ahead + (now - t[n0]));
+	struct nk_vec2 d = nk_vec2(v.x * ta + 0.5f * a.x * ta * ta, v.y * ta + 0.5f * a.y * ta * ta);
+	float limit = fminf(1.5f * sqrtf(v.x * v.x + v.y * v.y) * ta, PREDICT_MAX_PIXELS), length = sqrtf(d.x * d.x + d.y * d.y);
+	if (length > limit && length > 0.0f)
 	{
-		idleCounter = 0;
-		const char nl = '\n';
-		int n = write(sockfd, &nl, 1);
+		d.x *= limit / length;
+		d.y *= limit / length;
 	}
+	predicted->x = fminf(fmaxf(p[n0].x + d.x, 0.0f), pixelsWidth - 1);
+	predicted->y = fminf(fmaxf(p[n0].y + d.y, 0.0f), pixelsHeight - 1);
+	return 1;
 }
 
-static unsigned char buffer[1024], *p = buffer;
-static void setPixel(int x, int y, struct nk_color color)
+static float oneEuroAlpha(float rate, float cutoff)
 {
-	if (x < 0 || y < 0 || x >= pixelsWidth || y >= pixelsHeight)
-		return;
+	float tau = 1.0f / (2.0f * (float)M_PI * cutoff);
+	return 1.0f / (1.0f + tau * rate);
+}
+
+static void stabilizerPush(struct nk_vec2 position, double time, brush_t *brush)
+{
+	// (re)start the filter at the beginning of a stroke or when another filter takes over
+	int first = stabilizer.brush == NULL || brush->smoothing != stabilizer.smoothing;
+	if (first)
+	{
+		stabilizer.head = stabilizer.count = 0;
+		stabilizer.sumx = stabilizer.sumy = 0;
+	}
+	stabilizer.brush = brush;
+	stabilizer.smoothing = brush->smoothing;
+	int n = (int)brush->stabilization;
 
-	// flush buffer if necessary
-	while (buffer + 1024 - p < 32)
+	switch (brush->smoothing)
+	{
+	case SMOOTHING_EXPONENTIAL:
+	{
+		float alpha = 2.0f / (n + 1);
+		if (first)
+			stabilizer.filtered = position;
+		stabilizer.filtered.x += alpha * (position.x - stabilizer.filtered.x);
+		stabilizer.filtered.y += alpha * (position.y - stabilizer.filtered.y);
+		stabilizerEmit(stabilizer.filtered, time, brush);
+		break;
+	}
+	case SMOOTHING_ONE_EURO:
 	{
-		int n;
-		do
+		if (first)
 		{
-			n = write(sockfd, buffer, p - buffer);
-		} while(n < 0 && errno == EAGAIN);
-		if (n < 0)
+			stabilizer.filtered = position;
+			stabilizer.speed = nk_vec2(0, 0);
+		}
+		else
 		{
-			if (errno == EPIPE)
-			{
-				printf("reconnecting.\n");
-				flutConnect();
-			}
-			else
-			{
-				fprintf(stderr, "ERROR %d writing to socket\n", errno);
-				exit(1);
-			}
+			// input times are estimates, samples closer than a millisecond would make the filter stall
+			float dt = (float)(time - stabilizer.lastTime);
+			float rate = 1.0f / (dt > 0.001f ? dt : 0.001f);
+			float a = oneEuroAlpha(rate, 1.0f);
+			stabilizer.speed.x += a * ((position.x - stabilizer.filtered.x) * rate - stabilizer.speed.x);
+			stabilizer.speed.y += a * ((position.y - stabilizer.filtered.y) * rate - stabilizer.speed.y);
+			float speed = sqrtf(stabilizer.speed.x * stabilizer.speed.x + stabilizer.speed.y * stabilizer.speed.y);
+			a = oneEuroAlpha(rate, 10.0f / n + brush->beta * speed);
+			stabilizer.filtered.x += a * (position.x - stabilizer.filtered.x);
+			stabilizer.filtered.y += a * (position.y - stabilizer.filtered.y);
 		}
-		if (n > 0)
+		stabilizer.lastTime = time;
+		stabilizerEmit(stabilizer.filtered, time, brush);
+		break;
+	}
+	default:
+	{
+		const int mask = MAX_STABILIZATION - 1;
+		while (stabilizer.count >= n)
 		{
-			memmove(buffer, buffer + n, p - (buffer + n));
-			p -= n;
-			idleCounter = 0;
+			struct nk_vec2 oldest = stabilizer.positions[(stabilizer.head - stabilizer.count) & mask];
+			stabilizer.sumx -= oldest.x;
+			stabilizer.sumy -= oldest.y;
+			stabilizer.count--;
 		}
+		stabilizer.positions[stabilizer.head] = position;
+		stabilizer.head = (stabilizer.head + 1) & mask;
+		stabilizer.count++;
+		stabilizer.sumx += position.x;
+		stabilizer.sumy += position.y;
+		if (stabilizer.count == n)
+			stabilizerEmit(nk_vec2((float)(stabilizer.sumx / n), (float)(stabilizer.sumy / n)), time, brush);
+		break;
+	}
 	}
-
-	// add pixel to buffer
-	*p++ = 'P'; *p++ = 'X'; *p++ = ' ';
-	p += itoa(x, p); *p++ = ' ';
-	p += itoa(y, p); *p++ = ' ';
-	const unsigned char hex[] = "0123456789abcdef";
-	*p++ = hex[color.r >> 4]; *p++ = hex[color.r & 0xf];
-	*p++ = hex[color.g >> 4]; *p++ = hex[color.g & 0xf];
-	*p++ = hex[color.b >> 4]; *p++ = hex[color.b & 0xf];
-	*p++ = hex[color.a >> 4]; *p++ = hex[color.a & 0xf];
-	*p++ = '\n';
-	
-	// set pixel locally
-	float alpha = color.a / 255.0f, nalpha = 1.0f - alpha;
-	uint8_t *pixel = pixels + (y * pixelsWidth + x) * 3;
-	pixel[0] = (uint8_t)(pixel[0] * nalpha + color.r * alpha);
-	pixel[1] = (uint8_t)(pixel[1] * nalpha + color.g * alpha);
-	pixel[2] = (uint8_t)(pixel[2] * nalpha + color.b * alpha);
 }
 
-struct
+// Input capture: the GLFW cursor and mouse button callbacks record every event into a lock-free
+// single producer, single consumer ring, so the stroke engine sees all samples since the last frame
+// instead of one position per frame. GLFW delivers them in a burst inside glfwPollEvents(), so the
+// time of delivery says nothing about when they happened; inputPoll() spreads the events of a
+// burst evenly over the time since the previous poll instead.
+#define INPUT_QUEUE_SIZE 1024 // power of two
+#define INPUT_MAX_SPREAD 0.05 // seconds, a burst after an idle pause is not spread over all of it
+typedef struct
 {
-	int x, y, w, h;
-	struct nk_color color;
-	int currentLine;
-} fillState = {0};
-static void fillRect(int x, int y, int w, int h, struct nk_color color)
+	double time; // estimated from the poll that delivered the event
+	float x, y; // window coordinates
+	int buttons; // bit (1 << GLFW_MOUSE_BUTTON_*) is set while that button is held
+} input_t;
+static struct
 {
-	fillState.x = x; fillState.y = y; fillState.w = w; fillState.h = h;
-	fillState.color = color;
-	fillState.currentLine = 0;
-}
-static int fillUpdate()
+	input_t events[INPUT_QUEUE_SIZE];
+	unsigned head, tail;
+	unsigned dropped;
+	int buttons;
+	float x, y;
+	double lastPoll;
+} input;
+static void inputPush(float x, float y, int buttons)
 {
-	if (fillState.currentLine < fillState.h)
+	unsigned head = input.head;
+	if (head - __atomic_load_n(&input.tail, __ATOMIC_ACQUIRE) == INPUT_QUEUE_SIZE)
 	{
-		for (int x = 0; x < fillState.w; x++)
-			setPixel(fillState.x + x, fillState.y + fillState.currentLine, fillState.color);
-		fillState.currentLine++;
-		return 1;
+		input.dropped++;
+		return;
 	}
-	return 0;
+	input_t *event = &input.events[head & (INPUT_QUEUE_SIZE - 1)];
+	event->time = 0; // set by inputPoll()
+	event->x = x; event->y = y;
+	event->buttons = buttons;
+	__atomic_store_n(&input.head, head + 1, __ATOMIC_RELEASE);
 }
-
-typedef struct
+static int inputPop(input_t *event)
 {
-	char name[64];
-	struct nk_color color;
-	nk_size size;
-	nk_size stabilization;
-	nk_size spray;
-	nk_size shape;
-} brush_t;
-static void brushPoint(int x, int y, brush_t *brush)
+	unsigned tail = input.tail;
+	if (tail == __atomic_load_n(&input.head, __ATOMIC_ACQUIRE))
+		return 0;
+	*event = input.events[tail & (INPUT_QUEUE_SIZE - 1)];
+	__atomic_store_n(&input.tail, tail + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+static void cursorPosCallback(GLFWwindow *window, double x, double y)
 {
-	float radius = brush->size / 2.0f;
-	x -= (int)ceilf(radius);
-	y -= (int)ceilf(radius);
-	float a2 = powf(brush->color.a / 255.0f, 1.0f / 5.0f);
-	struct nk_color color = brush->color;
-	for (int yi = 0; yi < brush->size + 1; yi++)
-	{
-		float dy = abs(yi - radius);
-		for (int xi = 0; xi < brush->size + 1; xi++)
-		{
-			if ((rand() % 100) % brush->spray == 0)
-			{
-				float dx = abs(xi - radius);
-				float alpha = a2 * (1.0f - (sqrtf(dx * dx + dy * dy) / radius * (brush->shape/10.0)));
-				if (alpha > 0.0f)
-				{
-					alpha = powf(alpha, 7.0f);
-					alpha *= 255.0f;
-					if (alpha >= 1.0f)
-					{
-						color.a = (uint8_t)alpha;
-						setPixel(x + xi, y + yi, color);
-					}
-				}
-			}
-		}
-	}
+	input.x = (float)x; input.y = (float)y;
+	inputPush(input.x, input.y, input.buttons);
 }
-
-static void brushLine(struct nk_vec2 p0, struct nk_vec2 p1, brush_t *brush)
+static void mouseButtonCallback(GLFWwindow *window, int button, int action, int mods)
+{
+	if (button > GLFW_MOUSE_BUTTON_MIDDLE)
+		return;
+	if (action == GLFW_PRESS)
+		input.buttons |= 1 << button;
+	else
+		input.buttons &= ~(1 << button);
+	inputPush(input.x, input.y, input.buttons);
+}
+static void inputPoll()
 {
-	int x0 = (int)roundf(p0.x), y0 = (int)roundf(p0.y);
-	int x1 = (int)roundf(p1.x), y1 = (int)roundf(p1.y);
-	int dx = abs(x1 - x0), sx = x0 < x1 ? 1 : -1;
-	int dy = abs(y1 - y0), sy = y0 < y1 ? 1 : -1; 
-	int err = (dx > dy ? dx : -dy) / 2, e2;
+	unsigned first = input.head;
+	glfwPollEvents();
+	double now = glfwGetTime(), last = now - input.lastPoll < INPUT_MAX_SPREAD ? input.lastPoll : now - INPUT_MAX_SPREAD;
+	unsigned count = input.head - first;
+	for (unsigned i = 0; i < count; i++)
+		input.events[(first + i) & (INPUT_QUEUE_SIZE - 1)].time = last + (now - last) * (i + 1) / count;
+	input.lastPoll = now;
+}
 
-	for(;;)
+// feeds one input sample, relative to the canvas at origin, into the stroke engine
+static void strokeInput(const input_t *event, struct nk_vec2 origin, brush_t *fg, brush_t *bg)
+{
+	if (event->buttons & (1 << GLFW_MOUSE_BUTTON_LEFT))
 	{
-		brushPoint(x0, y0, brush); // TODO: optimize number of sent pixels!
-		if (x0 == x1 && y0 == y1)
-			break;
-		e2 = err;
-		if (e2 > -dx) { err -= dy; x0 += sx; }
-		if (e2 <  dy) { err += dx; y0 += sy; }
+		brush_t *brush = event->buttons & (1 << GLFW_MOUSE_BUTTON_MIDDLE) ? bg : fg;
+		stabilizerPush(nk_vec2(event->x - origin.x, event->y - origin.y), event->time, brush);
 	}
+	else if (stabilizer.brush)
+		stabilizerReset();
 }
 
 static void error_callback(int e, const char *d)
@@ -272,19 +4539,68 @@ static void error_callback(int e, const char *d)
 
 int main(int argc, char **argv)
 {
-	if (argc < 3)
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	rngSeedValue = (uint64_t)now.tv_sec * 1000000 + now.tv_usec;
+
+	int workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	int opt;
+	int probing = 0, selfTesting = 0;
+	const char *blobPath = NULL, *gatewayPath = NULL, *imagePath = NULL, *videoPath = NULL;
+	while ((opt = getopt(argc, argv, "b:g:i:l:ps:tu:v:w:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'b': blobPath = optarg; break;
+		case 'g': gatewayPath = optarg; break;
+		case 'i': imagePath = optarg; break;
+		case 's': rngSeedValue = strtoull(optarg, NULL, 0); break;
+		case 't': selfTesting = 1; break;
+		case 'w': workers = atoi(optarg); break;
+		case 'l': lowLatencyKiB = atoi(optarg); break;
+		case 'p': probing = 1; break;
+		case 'u': udp.port = atoi(optarg); break;
+		case 'v': videoPath = optarg; break;
+		default: argc = 0; break;
+		}
+	}
+	if (selfTesting)
+	{
+		blendInit();
+		encodeInit();
+		exit(selfTest() ? 1 : 0);
+	}
+	if (argc - optind < 2)
 	{
-		fprintf(stderr, "usage %s hostname port\n", argv[0]);
+		fprintf(stderr, "usage %s [-b blob] [-g gateway socket] [-i image] [-l kernel queue KiB] [-p] [-s seed] [-t] [-u udp port] [-v video] [-w workers] hostname port\n", argv[0]);
 		exit(0);
 	}
+	rngSeed(&rng, rngSeedValue, 0);
+	printf("Random seed: %llu\n", (unsigned long long)rngSeedValue);
 
-	struct timeval T1;
-	srand(T1.tv_usec);
+	blendInit();
+	encodeInit();
+	for (int i = 0; i < MAX_WORKERS; i++)
+		strokeBuffers[i].growable = 1;
+	poolInit(workers);
 
-	hostname = argv[1];
-	port = atoi(argv[2]);
+	hostname = argv[optind];
+	port = atoi(argv[optind + 1]);
 	flutConnect();
 	readSize();
+	detectColorForms();
+	if (probing)
+		probe();
+	else
+		probeLoad();
+	if (blobPath)
+		blobOpen(blobPath);
+	if (udp.port)
+		udpConnect();
+	if (videoPath)
+		videoOpen(videoPath);
+	senderInit();
+	encodersInit(workerCount);
 
 	glfwSetErrorCallback(error_callback);
 	if (!glfwInit())
@@ -304,6 +4620,20 @@ int main(int argc, char **argv)
 	glfwSwapInterval(1);
 	
 	pixels = calloc(pixelsWidth * pixelsHeight * 3, 1);
+	speculative = calloc(pixelsWidth * pixelsHeight, 1);
+	refineMarks = calloc(pixelsWidth * pixelsHeight, 1);
+	sent = calloc(pixelsWidth * pixelsHeight * 3, 1);
+	sentEpoch = calloc(pixelsWidth * pixelsHeight, 1);
+	defenseInit();
+	blobApply();
+	if (udp.port)
+		udpStart();
+	videoStart();
+	if (imagePath)
+		imageStart(imagePath);
+	if (gatewayPath)
+		gatewayStart(gatewayPath);
+	int blobSaved = -1;
 	GLuint texture;
 	glGenTextures(1, &texture);
 	glBindTexture(GL_TEXTURE_2D, texture);
@@ -318,14 +4648,11 @@ int main(int argc, char **argv)
 	nk_glfw3_font_stash_begin(&atlas);
 	nk_glfw3_font_stash_end();
 
-	struct
-	{
-		#define MAX_STABILIZATION 32
-		struct nk_vec2 positions[MAX_STABILIZATION];
-		nk_size writeIndex;
-		struct nk_vec2 lastAverage;
-	} stabilizer = {0};
-	stabilizer.lastAverage = nk_vec2(-1, -1);
+	double cursorX, cursorY;
+	glfwGetCursorPos(window, &cursorX, &cursorY);
+	input.x = (float)cursorX; input.y = (float)cursorY;
+	glfwSetCursorPosCallback(window, cursorPosCallback);
+	glfwSetMouseButtonCallback(window, mouseButtonCallback);
 
 	#define MAX_BRUSHES 32
 	int brushCount = 2;
@@ -338,6 +4665,7 @@ int main(int argc, char **argv)
 	brushes[0].stabilization = 8;
 	brushes[0].spray = 1;
 	brushes[0].shape = 10;
+	brushes[0].beta = 0.01f;
 	brush_t *fg = &brushes[0];
 
 	// default background brush
@@ -347,17 +4675,24 @@ int main(int argc, char **argv)
 	brushes[1].stabilization = 1;
 	brushes[1].spray = 1;
 	brushes[1].shape = 10;
+	brushes[1].beta = 0.01f;
 	brush_t *bg = &brushes[1];
 
+	jobAdd("Fill", fillStep);
+	jobAdd("Refine", refineStep);
+	jobAdd("Defense", defenseStep);
+	jobAdd("Video", videoStep);
+	jobAdd("Image", imageStep);
+	jobAdd("Gateway", gatewayStep);
+
 	while (!glfwWindowShouldClose(window))
 	{
-		glfwPollEvents();
+		schedulerFrame();
+		inputPoll();
 		int w, h;
 		glfwGetFramebufferSize(window, &w, &h);
 		nk_glfw3_new_frame();
 
-		keepAlive();
-
 		glBindTexture(GL_TEXTURE_2D, texture);
 		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, pixelsWidth, pixelsHeight, 0, GL_RGB, GL_UNSIGNED_BYTE, pixels);
 		struct nk_panel canvas;
@@ -369,45 +4704,47 @@ int main(int argc, char **argv)
 			struct nk_vec2 canvasPosition = nk_widget_position(ctx);
 			nk_image(ctx, nk_image_id(texture));
 
-			// brush strokes and stabilization
-			if (glfwGetMouseButton(window, GLFW_MOUSE_BUTTON_LEFT) == GLFW_PRESS)
-			{
-				brush_t *brush = fg;
-				if (glfwGetMouseButton(window, GLFW_MOUSE_BUTTON_MIDDLE) == GLFW_PRESS)
-					brush = bg;
+			// last frame's guess must not overtake the real stroke
+			laneDiscard(LANE_PREDICTION);
+			qualityUpdate();
 
-				stabilizer.positions[stabilizer.writeIndex] = nk_vec2(
-					ctx->input.mouse.pos.x - canvasPosition.x,
-					ctx->input.mouse.pos.y - canvasPosition.y);
-				if (++stabilizer.writeIndex >= brush->stabilization)
-				{
-					float sumx = 0, sumy = 0;
-					for (int i = 0; i < brush->stabilization; i++)
-					{
-						sumx += stabilizer.positions[i].x;
-						sumy += stabilizer.positions[i].y;
-					}
-					struct nk_vec2 avg = nk_vec2(sumx / brush->stabilization, sumy / brush->stabilization);
-					if (avg.x >= 0 && avg.y >= 0 && avg.x <= pixelsWidth - 1 && avg.y <= pixelsHeight - 1)
-					{
-						if (stabilizer.lastAverage.x == -1 && stabilizer.lastAverage.y == -1)
-							stabilizer.lastAverage = avg;
-						if ((int)roundf(avg.x) != (int)roundf(stabilizer.lastAverage.x) ||
-							(int)roundf(avg.y) != (int)roundf(stabilizer.lastAverage.y))
-							brushLine(stabilizer.lastAverage, avg, brush);
-						stabilizer.lastAverage = avg;
-					}
-					
-					// make room for next mouse position in stabilizer buffer
-					for (int i = 0; i < stabilizer.writeIndex - 1; i++)
-						stabilizer.positions[i] = stabilizer.positions[i + 1];
-					stabilizer.writeIndex--;
-				}
+			// brush strokes and stabilization from every input sample since the last frame
+			input_t event;
+			int samples = 0;
+			while (inputPop(&event))
+			{
+				strokeInput(&event, canvasPosition, fg, bg);
+				samples++;
 			}
-			else
+			if (!samples && (input.buttons & (1 << GLFW_MOUSE_BUTTON_LEFT)))
 			{
-				stabilizer.writeIndex = 0;
-				stabilizer.lastAverage = nk_vec2(-1, -1);
+				// a resting cursor still pulls the stabilized stroke towards it once per frame
+				event.time = input.lastPoll;
+				event.x = input.x; event.y = input.y;
+				event.buttons = input.buttons;
+				strokeInput(&event, canvasPosition, fg, bg);
+			}
+			strokeFlush();
+
+			// replace last frame's guess by the real stroke and guess again
+			predictionCorrect();
+			struct nk_vec2 predicted;
+			if (predictionMs > 0 && stabilizer.lastAverage.x != -1 &&
+				stabilizerPredict(glfwGetTime(), predictionMs / 1000.0, &predicted))
+				predictionDraw(stabilizer.lastAverage, predicted, stabilizer.brush);
+			senderFlush(); // end of frame
+		}
+		else
+		{
+			// nothing to draw on: the samples are dropped, and the stroke ends where it was so the
+			// next one does not join up with it
+			input_t event;
+			while (inputPop(&event));
+			if (stabilizer.brush)
+			{
+				stabilizerReset();
+				strokeFlush();
+				senderFlush();
 			}
 		}
 		nk_end(ctx);
@@ -436,6 +4773,48 @@ int main(int argc, char **argv)
 			nk_layout_row_dynamic(ctx, 25, 1);
 			bgIndex = nk_combo(ctx, brushNames, brushCount, bgIndex, 25);
 
+			nk_layout_row_dynamic(ctx, 25, 1);
+			nk_property_int(ctx, "Prediction (ms):", 0, &predictionMs, 200, 5, 1);
+			nk_layout_row_dynamic(ctx, 25, 1);
+			nk_property_int(ctx, "Congestion (KiB):", 4, &congestionKiB, 4096, 4, 1);
+			nk_layout_row_dynamic(ctx, 15, 1);
+			nk_labelf(ctx, NK_TEXT_LEFT, "Alpha cut-off %d, %d to refine", qualityCutoff, refine.count - refine.start);
+
+			nk_layout_row_dynamic(ctx, 15, 1);
+			nk_label(ctx, "Send Scheduling:", NK_TEXT_LEFT);
+			nk_layout_row_dynamic(ctx, 25, 1);
+			sendPolicy = nk_combo(ctx, sendPolicyNames, SEND_POLICY_COUNT, sendPolicy, 25);
+			nk_layout_row_dynamic(ctx, 25, 1);
+			nk_property_int(ctx, "Flush Deadline (ms):", 0, &flushDeadlineMs, 100, 1, 1);
+			nk_layout_row_dynamic(ctx, 25, 1);
+			nk_property_int(ctx, "Flush Size (KiB):", 1, &flushKiB, 1024, 1, 1);
+			nk_layout_row_dynamic(ctx, 25, 1);
+			nk_property_int(ctx, "Write Size (KiB):", 1, &writeKiB, MAX_WRITE / 1024, 1, 1);
+			nk_layout_row_dynamic(ctx, 25, 1);
+			nk_property_int(ctx, "Pace (KiB/s, 0 off):", 0, &paceKiBps, 1024 * 1024, 64, 16);
+			for (int i = 0; i < LANE_COUNT; i++)
+			{
+				nk_layout_row_dynamic(ctx, 15, 1);
+				nk_labelf(ctx, NK_TEXT_LEFT, "%s: %zu KiB queued", laneNames[i], laneQueued(i) / 1024);
+			}
+			int kernelQueued, kernelUnsent;
+			socketQueue(sockfd, &kernelQueued, &kernelUnsent);
+			nk_layout_row_dynamic(ctx, 15, 1);
+			nk_labelf(ctx, NK_TEXT_LEFT, "Kernel: %d KiB (%d KiB unsent)", kernelQueued / 1024, kernelUnsent / 1024);
+			if (lowLatencyKiB)
+			{
+				nk_layout_row_dynamic(ctx, 25, 1);
+				int kib = lowLatencyKiB;
+				nk_property_int(ctx, "Kernel Queue (KiB):", 1, &kib, 1024, 1, 1);
+				if (kib != lowLatencyKiB)
+				{
+					lowLatencyKiB = kib;
+					#ifdef TCP_NOTSENT_LOWAT
+					setsockopt(sockfd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &(int){ kib * 1024 }, sizeof(int));
+					#endif
+				}
+			}
+
 			nk_layout_row_dynamic(ctx, 15, 1); // empty
 			nk_layout_row_dynamic(ctx, 15, 1);
 			nk_label(ctx, "Brush Editor:", NK_TEXT_LEFT);
@@ -453,7 +4832,7 @@ int main(int argc, char **argv)
 					nk_layout_row_dynamic(ctx, 15, 1);
 					nk_label(ctx, "Brush Size:", NK_TEXT_LEFT);
 					nk_layout_row_dynamic(ctx, 20, 1);
-					nk_progress(ctx, &brush->size, 50, 1);
+					nk_progress(ctx, &brush->size, MAX_BRUSH_SIZE, 1);
 					if (brush->size < 1)
 						brush->size = 1;
 
@@ -465,6 +4844,15 @@ int main(int argc, char **argv)
 						brush->stabilization = 1;
 					if (brush->stabilization >= MAX_STABILIZATION)
 						brush->stabilization = MAX_STABILIZATION - 1;
+					nk_layout_row_dynamic(ctx, 25, 1);
+					brush->smoothing = nk_combo(ctx, smoothingNames, SMOOTHING_COUNT, brush->smoothing, 25);
+					if (brush->smoothing == SMOOTHING_ONE_EURO)
+					{
+						nk_layout_row_dynamic(ctx, 25, 1);
+						nk_property_float(ctx, "Speed Response:", 0.0f, &brush->beta, 0.1f, 0.001f, 0.0001f);
+					}
+					nk_layout_row_dynamic(ctx, 20, 1);
+					nk_checkbox_label(ctx, "Smooth Curves", &brush->interpolate);
 
 					nk_layout_row_dynamic(ctx, 15, 1);
 					nk_label(ctx, "Spray:", NK_TEXT_LEFT);
@@ -474,6 +4862,8 @@ int main(int argc, char **argv)
 						brush->spray = 1;
 					if (brush->spray >= 101)
 						brush->spray = 10;
+					nk_layout_row_dynamic(ctx, 20, 1);
+					nk_checkbox_label(ctx, "Blue-noise Spray", &brush->sprayMask);
 
 					nk_layout_row_dynamic(ctx, 15, 1);
 					nk_label(ctx, "Brush Shape:", NK_TEXT_LEFT);
@@ -510,6 +4900,7 @@ int main(int argc, char **argv)
 					strcpy(brushes[brushCount].name, "New Brush");
 					brushes[brushCount].size = 1;
 					brushes[brushCount].stabilization = 1;
+					brushes[brushCount].beta = 0.01f;
 					brushes[brushCount].color = nk_rgba(255, 255, 255, 255);
 					fgIndex = brushCount;
 					brushCount++;
@@ -530,14 +4921,118 @@ int main(int argc, char **argv)
 			fg = brushes + fgIndex;
 			bg = brushes + bgIndex;
 
-			if (fillUpdate())
+			nk_layout_row_dynamic(ctx, 25, 1);
+			int suppress = suppressSeconds;
+			nk_property_int(ctx, "Suppress (s, 0 off):", 0, &suppress, 250, 1, 1);
+			suppressSet(suppress);
+			nk_layout_row_dynamic(ctx, 15, 1);
+			nk_labelf(ctx, NK_TEXT_LEFT, "%llu pixels suppressed", (unsigned long long)__atomic_load_n(&suppressed, __ATOMIC_RELAXED));
+
+			nk_layout_row_dynamic(ctx, 20, 1);
+			nk_checkbox_label(ctx, "Defend Canvas", &defense.enabled);
+			if (defense.enabled)
+			{
+				nk_layout_row_dynamic(ctx, 25, 1);
+				nk_property_int(ctx, "Defense (KiB/s):", 1, &defense.kiBps, 64 * 1024, 16, 4);
+				nk_layout_row_dynamic(ctx, 15, 1);
+				nk_labelf(ctx, NK_TEXT_LEFT, "%llu pixels repaired", (unsigned long long)defense.repaired);
+			}
+			if (blob.map)
+			{
+				nk_layout_row_dynamic(ctx, 25, 1);
+				nk_checkbox_label(ctx, "Hold Blob", &blob.hold);
+				nk_layout_row_dynamic(ctx, 15, 1);
+				nk_labelf(ctx, NK_TEXT_LEFT, "%llu loops sent", (unsigned long long)__atomic_load_n(&blob.loops, __ATOMIC_RELAXED));
+			}
+			nk_layout_row_dynamic(ctx, 25, 1);
+			if (nk_button_label(ctx, "Save Blob", NK_BUTTON_DEFAULT))
+				blobSaved = blobSave(blobPath ? blobPath : "canvas.blob");
+			if (blobSaved >= 0)
+			{
+				nk_layout_row_dynamic(ctx, 15, 1);
+				nk_labelf(ctx, NK_TEXT_LEFT, blobSaved ? "Saved %s" : "Could not save %s", blobPath ? blobPath : "canvas.blob");
+			}
+
+			nk_layout_row_dynamic(ctx, 15, 1);
+			nk_label(ctx, "Bulk Order:", NK_TEXT_LEFT);
+			nk_layout_row_dynamic(ctx, 25, 1);
+			bulkOrder = nk_combo(ctx, orderNames, ORDER_COUNT, bulkOrder, 25);
+			nk_layout_row_dynamic(ctx, 25, 1);
+			nk_checkbox_label(ctx, "Send Chunks In Order", &bulkOrdered);
+			if (fillState.active)
 			{
 				nk_layout_row_dynamic(ctx, 15, 1);
 				nk_label(ctx, "Filling in progress", NK_TEXT_LEFT);
 			}
+			nk_layout_row_dynamic(ctx, 15, 1);
+			nk_labelf(ctx, NK_TEXT_LEFT, "Encoders: %d, %d chunks in flight", encoders.count, encoders.inFlight);
+			if (udp.fd >= 0)
+			{
+				nk_layout_row_dynamic(ctx, 25, 1);
+				int kiBps = udp.kiBps;
+				nk_property_int(ctx, "UDP Limit (KiB/s):", 64, &kiBps, 1024 * 1024, 1024, 64);
+				__atomic_store_n(&udp.kiBps, kiBps, __ATOMIC_RELAXED);
+				double rate, loss;
+				__atomic_load(&udp.rate, &rate, __ATOMIC_RELAXED);
+				__atomic_load(&udp.loss, &loss, __ATOMIC_RELAXED);
+				nk_layout_row_dynamic(ctx, 15, 1);
+				nk_labelf(ctx, NK_TEXT_LEFT, "UDP: %.0f KiB/s, %.1f%% lost", rate / 1024, loss * 100);
+				nk_layout_row_dynamic(ctx, 15, 1);
+				nk_labelf(ctx, NK_TEXT_LEFT, "%llu datagrams, %llu of %llu samples lost",
+					(unsigned long long)__atomic_load_n(&udp.datagrams, __ATOMIC_RELAXED),
+					(unsigned long long)__atomic_load_n(&udp.lost, __ATOMIC_RELAXED),
+					(unsigned long long)__atomic_load_n(&udp.checked, __ATOMIC_RELAXED));
+			}
+			if (video.source.shown)
+			{
+				nk_layout_row_dynamic(ctx, 25, 1);
+				nk_checkbox_label(ctx, "Play Video", &video.playing);
+				nk_layout_row_dynamic(ctx, 15, 1);
+				pthread_mutex_lock(&video.mutex); // the video thread counts under it
+				uint64_t frames = video.frames, dropped = video.dropped;
+				pthread_mutex_unlock(&video.mutex);
+				nk_labelf(ctx, NK_TEXT_LEFT, "%llu frames, %llu dropped%s", (unsigned long long)frames,
+					(unsigned long long)dropped, __atomic_load_n(&video.ended, __ATOMIC_ACQUIRE) ? ", ended" : "");
+				nk_layout_row_dynamic(ctx, 15, 1);
+				nk_labelf(ctx, NK_TEXT_LEFT, "Budget: %.0f pixels per frame", video.budget);
+			}
+			if (image.path)
+			{
+				nk_layout_row_dynamic(ctx, 15, 1);
+				pthread_mutex_lock(&image.mutex); // the watcher thread counts under it
+				uint64_t versions = image.versions, failed = image.failed;
+				pthread_mutex_unlock(&image.mutex);
+				nk_labelf(ctx, NK_TEXT_LEFT, "Image: %llu versions, %llu unreadable, %llu resent", (unsigned long long)versions,
+					(unsigned long long)failed, (unsigned long long)image.resends);
+				nk_layout_row_dynamic(ctx, 15, 1);
+				nk_labelf(ctx, NK_TEXT_LEFT, "%d of %d tiles to send, %llu pixels sent", image.count - image.next,
+					image.count, (unsigned long long)image.sent);
+			}
+			if (gateway.ring)
+			{
+				nk_layout_row_dynamic(ctx, 15, 1);
+				nk_labelf(ctx, NK_TEXT_LEFT, "Gateway: %d clients, %llu commands, %llu bad", __atomic_load_n(&gateway.clients, __ATOMIC_RELAXED),
+					(unsigned long long)gateway.commands, (unsigned long long)gateway.errors);
+				nk_layout_row_dynamic(ctx, 15, 1);
+				nk_labelf(ctx, NK_TEXT_LEFT, "%llu spans, %llu pixels drained", (unsigned long long)gateway.spans,
+					(unsigned long long)gateway.pixels);
+			}
+
+			nk_layout_row_dynamic(ctx, 15, 1); // empty
+			nk_layout_row_dynamic(ctx, 25, 1);
+			nk_property_int(ctx, "Frame Target (ms):", 4, &frameTargetMs, 100, 1, 1);
+			nk_layout_row_dynamic(ctx, 15, 1);
+			nk_labelf(ctx, NK_TEXT_LEFT, "Job budget: %.1f ms", scheduler.budget * 1000.0);
+			for (int i = 0; i < jobCount; i++)
+			{
+				nk_layout_row_dynamic(ctx, 15, 1);
+				nk_labelf(ctx, NK_TEXT_LEFT, "%s: %.0f%%", jobs[i].name, jobs[i].share * 100.0);
+			}
 		}
 		nk_end(ctx);
 
+		jobsRun();
+
 		glViewport(0, 0, w, h);
 		glClearColor(0.1f, 0.1f, 0.1f, 1.0f);
 		glClear(GL_COLOR_BUFFER_BIT);
@@ -545,6 +5040,14 @@ int main(int argc, char **argv)
 		glfwSwapBuffers(window);
 	}
 	nk_glfw3_shutdown();
+	free(speculativeList);
+	free(speculative);
+	free(refineMarks);
+	free(sent);
+	free(sentEpoch);
+	free(remote);
+	free(owned);
+	free(tiles);
 	free(pixels);
 	glfwTerminate();
 	
@@ -0,0 +1,96 @@
+#!/usr/bin/env python3
+# Stand-in pixelflut server for trying the UDP transport (-u) without a real wall.
+#
+#   python3 tools/udp_standin.py [port] [width] [height]
+#   ./pinselflut -u <port> 127.0.0.1 <port>
+#
+# TCP accepts SIZE, PX x y (read back), PX x y gg|rrggbb|rrggbbaa and STATS, which answers
+# "STATS <datagrams> <records>". UDP on the same port takes datagrams of 8 byte records:
+# x and y as little endian 16 bit numbers, then r, g, b, a. Defaults: port 1234, 640x480.
+import socket
+import struct
+import sys
+import threading
+
+port = int(sys.argv[1]) if len(sys.argv) > 1 else 1234
+width = int(sys.argv[2]) if len(sys.argv) > 2 else 640
+height = int(sys.argv[3]) if len(sys.argv) > 3 else 480
+canvas = bytearray(width * height * 3)
+stats = {'datagrams': 0, 'records': 0}
+lock = threading.Lock()
+
+
+def paint(x, y, r, g, b, a):
+    if x >= width or y >= height:
+        return
+    i = (y * width + x) * 3
+    if a == 255:
+        canvas[i:i + 3] = bytes((r, g, b))
+    elif a:
+        for j, c in enumerate((r, g, b)):
+            canvas[i + j] = (canvas[i + j] * (255 - a) + c * a + 127) // 255
+
+
+def udp():
+    u = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    u.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 1 << 20)
+    u.bind(('', port))
+    while True:
+        data = u.recv(65536)
+        with lock:
+            stats['datagrams'] += 1
+            stats['records'] += len(data) // 8
+            for record in struct.iter_unpack('<HHBBBB', data[:len(data) // 8 * 8]):
+                paint(*record)
+
+
+def command(words):
+    if words[0] == b'SIZE':
+        return b'SIZE %d %d\n' % (width, height)
+    if words[0] == b'STATS':
+        return b'STATS %d %d\n' % (stats['datagrams'], stats['records'])
+    if words[0] != b'PX' or len(words) not in (3, 4):
+        return b''
+    x, y = int(words[1]), int(words[2])
+    if x < 0 or y < 0 or x >= width or y >= height:
+        return b''
+    if len(words) == 3:
+        i = (y * width + x) * 3
+        return b'PX %d %d %s\n' % (x, y, canvas[i:i + 3].hex().encode())
+    color = bytes.fromhex(words[3].decode())
+    if len(color) == 1:
+        color = color * 3
+    paint(x, y, *color[:3], color[3] if len(color) == 4 else 255)
+    return b''
+
+
+def client(connection):
+    pending = b''
+    while True:
+        data = connection.recv(65536)
+        if not data:
+            return
+        lines = (pending + data).split(b'\n')
+        pending = lines.pop()
+        answers = []
+        with lock:
+            for line in lines:
+                words = line.split()
+                if words:
+                    try:
+                        answers.append(command(words))
+                    except ValueError:
+                        pass
+        if any(answers):
+            connection.sendall(b''.join(answers))
+
+
+threading.Thread(target=udp, daemon=True).start()
+server = socket.socket()
+server.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+server.bind(('', port))
+server.listen()
+print('Listening on TCP and UDP port %d, %dx%d' % (port, width, height))
+while True:
+    connection, _ = server.accept()
+    threading.Thread(target=client, args=(connection,), daemon=True).start()